@@ -40,7 +40,9 @@ LOCAL_C_INCLUDES := \
 LOCAL_SRC_FILES := \
 	autolock.cpp \
 	drmresources.cpp \
+	drmcommitworker.cpp \
 	drmconnector.cpp \
+	drmcompositorworker.cpp \
 	drmcrtc.cpp \
 	drmdisplaycomposition.cpp \
 	drmdisplaycompositor.cpp \
@@ -50,6 +52,7 @@ LOCAL_SRC_FILES := \
 	drmmode.cpp \
 	drmplane.cpp \
 	drmproperty.cpp \
+	glcompositorworker.cpp \
 	glworker.cpp \
 	hwcutils.cpp \
         platform.cpp \
@@ -57,7 +60,9 @@ LOCAL_SRC_FILES := \
 	platformia.cpp \
         platformnv.cpp \
 	separate_rects.cpp \
+	synctimeline.cpp \
 	virtualcompositorworker.cpp \
+	vsyncmodel.cpp \
 	vsyncworker.cpp \
 	worker.cpp
 
@@ -0,0 +1,707 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-drm-commit-worker"
+
+#include "drmcommitworker.h"
+#include "autolock.h"
+#include "drmdisplaycomposition.h"
+#include "drmdisplaycompositor.h"
+#include "drmeventlistener.h"
+#include "drmplane.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <sync/sync.h>
+#include <system/thread_defs.h>
+
+namespace android {
+
+static const int64_t kMillion = 1000000LL;
+static const int64_t kBillion = 1000000000LL;
+
+static int64_t GetTimeNs() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+  return ts.tv_sec * kBillion + ts.tv_nsec;
+}
+
+// Duplicates the acquire fences of layers scanned out by planes that can't
+// wait for them through IN_FENCE_FD, which haven't signaled yet. Layers with
+// planes of their own are left out with skip_layers.
+static void GetPendingFences(DrmDisplayComposition *composition,
+                             bool skip_layers, std::vector<UniqueFd> *fences) {
+  std::vector<DrmHwcLayer> &layers = composition->layers();
+  for (DrmCompositionPlane &comp_plane : composition->composition_planes()) {
+    if (comp_plane.type() == DrmCompositionPlane::Type::kDisable ||
+        (skip_layers &&
+         comp_plane.type() == DrmCompositionPlane::Type::kLayer) ||
+        comp_plane.plane()->in_fence_fd_property().id())
+      continue;
+
+    for (size_t source_layer : comp_plane.source_layers()) {
+      if (source_layer >= layers.size())
+        continue;
+      int fence = layers[source_layer].acquire_fence.get();
+      if (fence < 0 || sync_wait(fence, 0) == 0)
+        continue;
+      fences->emplace_back(dup(fence));
+    }
+  }
+}
+
+// Whether a layer with a plane of its own is still waiting for its buffer,
+// whether or not the plane could wait for it through IN_FENCE_FD. Such a wait
+// would hold up the whole frame past its vblank.
+static bool HasLateLayers(DrmDisplayComposition *composition) {
+  std::vector<DrmHwcLayer> &layers = composition->layers();
+  for (DrmCompositionPlane &comp_plane : composition->composition_planes()) {
+    if (comp_plane.type() != DrmCompositionPlane::Type::kLayer)
+      continue;
+
+    for (size_t source_layer : comp_plane.source_layers()) {
+      if (source_layer >= layers.size())
+        continue;
+      int fence = layers[source_layer].acquire_fence.get();
+      if (fence >= 0 && sync_wait(fence, 0) != 0)
+        return true;
+    }
+  }
+  return false;
+}
+
+static int AddToEpoll(int epoll_fd, int fd) {
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+    ALOGE("Failed to add fd %d to epoll %d", fd, -errno);
+    return -errno;
+  }
+  return 0;
+}
+
+// Receives the page flip event of a commit, which carries the time of the
+// vblank its frame was latched at
+class LatchHandler : public DrmEventHandler {
+ public:
+  LatchHandler(std::shared_ptr<CommitTiming> timing, int64_t target_ns,
+               int64_t commit_ns)
+      : timing_(std::move(timing)),
+        target_ns_(target_ns),
+        commit_ns_(commit_ns) {
+  }
+
+  void HandleEvent(uint64_t timestamp_us) override {
+    timing_->RecordLatch(target_ns_, commit_ns_, (int64_t)timestamp_us * 1000);
+  }
+
+ private:
+  std::shared_ptr<CommitTiming> timing_;
+  int64_t target_ns_;
+  int64_t commit_ns_;
+};
+
+CommitTiming::CommitTiming(int64_t min_margin_ns)
+    : min_margin_ns_(min_margin_ns),
+      margin_ns_(min_margin_ns),
+      commit_cost_ns_(0),
+      period_ns_(0),
+      last_target_ns_(-1),
+      dump_latches_(0),
+      dump_misses_(0),
+      dump_last_target_ns_(-1),
+      dump_last_latch_ns_(-1),
+      dump_latch_offset_total_ns_(0),
+      dump_latch_offset_max_ns_(0),
+      dump_commit_to_latch_total_ns_(0) {
+  pthread_mutex_init(&lock_, NULL);
+}
+
+CommitTiming::~CommitTiming() {
+  pthread_mutex_destroy(&lock_);
+}
+
+int64_t CommitTiming::GetCommitTime(const VSyncModel &model, int64_t now_ns,
+                                    int64_t *target_ns) {
+  *target_ns = -1;
+  if (!model.locked())
+    return now_ns;
+
+  AutoLock lock(&lock_, "commit-timing");
+  if (lock.Lock())
+    return now_ns;
+
+  int64_t period = model.period();
+  int64_t lead = commit_cost_ns_ + margin_ns_;
+  int64_t target = model.GetNextVSync(now_ns + lead);
+  if (target < 0 || period <= 0)
+    return now_ns;
+
+  // The previous frame would be replaced before it was ever seen if this one
+  // went for the same vblank, which the crtc doesn't allow anyway
+  if (last_target_ns_ >= 0 && target < last_target_ns_ + period / 2)
+    target = model.GetNextVSync(last_target_ns_ + period / 2);
+
+  period_ns_ = period;
+  last_target_ns_ = target;
+  *target_ns = target;
+  return std::max(now_ns, target - lead);
+}
+
+void CommitTiming::RecordCommit(int64_t duration_ns) {
+  AutoLock lock(&lock_, "commit-timing");
+  if (lock.Lock())
+    return;
+
+  commit_cost_ns_ += (duration_ns - commit_cost_ns_) >> kCostAverageShift;
+}
+
+void CommitTiming::RecordLatch(int64_t target_ns, int64_t commit_ns,
+                               int64_t latch_ns) {
+  AutoLock lock(&lock_, "commit-timing");
+  if (lock.Lock())
+    return;
+
+  dump_last_target_ns_ = target_ns;
+  dump_last_latch_ns_ = latch_ns;
+  dump_commit_to_latch_total_ns_ += latch_ns - commit_ns;
+  dump_latches_++;
+  if (target_ns < 0 || period_ns_ <= 0)
+    return;
+
+  int64_t offset = latch_ns - target_ns;
+  dump_latch_offset_total_ns_ += offset;
+  dump_latch_offset_max_ns_ = std::max(dump_latch_offset_max_ns_, offset);
+
+  if (offset > period_ns_ / 2) {
+    dump_misses_++;
+    margin_ns_ = std::min(margin_ns_ * 2, period_ns_ / 2);
+  } else {
+    margin_ns_ =
+        std::max(min_margin_ns_, margin_ns_ - (margin_ns_ >> kMarginDecayShift));
+  }
+}
+
+void CommitTiming::Dump(std::ostringstream *out) const {
+  AutoLock lock(&lock_, "commit-timing");
+  if (lock.Lock())
+    return;
+
+  *out << "----Commit timing margin_us=" << margin_ns_ / 1000
+       << " cost_us=" << commit_cost_ns_ / 1000 << " latches=" << dump_latches_
+       << " misses=" << dump_misses_
+       << " last_target_ns=" << dump_last_target_ns_
+       << " last_latch_ns=" << dump_last_latch_ns_;
+  if (dump_latches_)
+    *out << " latch_offset_avg_us="
+         << dump_latch_offset_total_ns_ / (int64_t)dump_latches_ / 1000
+         << " latch_offset_max_us=" << dump_latch_offset_max_ns_ / 1000
+         << " commit_to_latch_avg_us="
+         << dump_commit_to_latch_total_ns_ / (int64_t)dump_latches_ / 1000;
+  *out << "\n";
+}
+
+DrmCommitWorker::DrmCommitWorker(DrmDisplayCompositor *compositor)
+    : Worker("drm-commit", HAL_PRIORITY_URGENT_DISPLAY),
+      compositor_(compositor),
+      enabled_(true),
+      substitute_late_(true),
+      mailbox_(false),
+      committing_(false),
+      late_layers_pending_(false),
+      late_layers_active_(false),
+      flush_(false),
+      exiting_(false),
+      dump_frames_(0),
+      dump_flushed_(0),
+      dump_dropped_(0),
+      dump_queue_max_(0),
+      dump_hold_total_ns_(0),
+      dump_hold_max_ns_(0),
+      dump_producer_waits_(0),
+      dump_producer_late_(0),
+      dump_acquire_timeouts_(0),
+      dump_producer_wait_total_ns_(0),
+      dump_producer_wait_max_ns_(0) {
+  pthread_mutex_init(&queue_lock_, NULL);
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&queue_cond_, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+}
+
+DrmCommitWorker::~DrmCommitWorker() {
+  if (initialized()) {
+    // The thread waits on queue_cond_ rather than for a signal, so it has to
+    // be woken up before Exit() can join it
+    pthread_mutex_lock(&queue_lock_);
+    exiting_ = true;
+    WakeLocked();
+    pthread_mutex_unlock(&queue_lock_);
+    Exit();
+  }
+
+  // Dropping a frame that was never committed signals its fences
+  queue_.clear();
+  pthread_cond_destroy(&queue_cond_);
+  pthread_mutex_destroy(&queue_lock_);
+}
+
+int DrmCommitWorker::Init() {
+  // Frames are held until just before the vblank they're for, unless
+  // hwc.drm.commit_jit is set to 0 to commit them as soon as they're queued.
+  // Commits are aimed hwc.drm.commit_margin_us before their vblank at least,
+  // plus however long they take.
+  char jit_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.commit_jit", jit_opt, "1");
+  enabled_ = atoi(jit_opt) != 0;
+
+  char margin_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.commit_margin_us", margin_opt, "1000");
+  int64_t margin_ns = atoll(margin_opt) * 1000;
+  if (margin_ns <= 0) {
+    ALOGW("Ignoring invalid commit margin %s", margin_opt);
+    margin_ns = 1000 * 1000;
+  }
+  timing_ = std::make_shared<CommitTiming>(margin_ns);
+
+  char substitute_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.substitute_late", substitute_opt, "1");
+  substitute_late_ = atoi(substitute_opt) != 0;
+
+  wake_fd_.Set(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+  timer_fd_.Set(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+  epoll_fd_.Set(epoll_create1(EPOLL_CLOEXEC));
+  if (wake_fd_.get() < 0 || timer_fd_.get() < 0 || epoll_fd_.get() < 0) {
+    ALOGE("Failed to create commit worker fds %d", -errno);
+    return -errno;
+  }
+  int ret = AddToEpoll(epoll_fd_.get(), wake_fd_.get());
+  if (!ret)
+    ret = AddToEpoll(epoll_fd_.get(), timer_fd_.get());
+  if (ret)
+    return ret;
+
+  return InitWorker();
+}
+
+void DrmCommitWorker::SetVSyncModel(std::shared_ptr<const VSyncModel> model) {
+  AutoLock lock(&queue_lock_, "drm-commit");
+  if (lock.Lock())
+    return;
+
+  model_ = std::move(model);
+}
+
+bool DrmCommitWorker::UpdateMailbox() {
+  char mode_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.present_mode", mode_opt, "fifo");
+  bool mailbox = !strcmp(mode_opt, "mailbox");
+
+  AutoLock lock(&queue_lock_, "drm-commit");
+  if (lock.Lock())
+    return false;
+
+  if (mailbox != mailbox_) {
+    // Frames are prepared on a different thread in each mode, so the ones
+    // queued already have to go before any of the other kind is prepared
+    FlushLocked();
+    ALOGI("Switching to %s presentation", mailbox ? "mailbox" : "fifo");
+    mailbox_ = mailbox;
+  }
+  return mailbox_;
+}
+
+bool DrmCommitWorker::CanReplaceLastLocked() const {
+  return mailbox_ && !queue_.empty() && !queue_.back().prepared &&
+         queue_.back().composition->squash_regions().empty();
+}
+
+int DrmCommitWorker::QueueFrame(
+    std::unique_ptr<DrmDisplayComposition> composition, bool prepared) {
+  AutoLock lock(&queue_lock_, "drm-commit");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  if (exiting_)
+    return -EINTR;
+
+  std::unique_ptr<DrmDisplayComposition> dropped;
+  if (!prepared && CanReplaceLastLocked()) {
+    dropped = std::move(queue_.back().composition);
+    queue_.pop_back();
+    dump_dropped_++;
+  }
+  queue_.push_back({std::move(composition), GetTimeNs(), prepared});
+  dump_queue_max_ = std::max(dump_queue_max_, queue_.size());
+  WakeLocked();
+  lock.Unlock();
+
+  // Releases everything the dropped frame held, signaling its fences
+  dropped.reset();
+  return 0;
+}
+
+void DrmCommitWorker::Flush() {
+  AutoLock lock(&queue_lock_, "drm-commit");
+  if (lock.Lock())
+    return;
+
+  FlushLocked();
+}
+
+void DrmCommitWorker::FlushLocked() {
+  // Late layers still waiting would be committed after whatever the caller
+  // goes on to do, so they're left for the next frame to bring along
+  late_layers_pending_ = false;
+  if (queue_.empty() && !committing_ && !late_layers_active_)
+    return;
+
+  flush_ = true;
+  dump_flushed_++;
+  WakeLocked();
+  while ((!queue_.empty() || committing_ || late_layers_active_) && !exiting_)
+    pthread_cond_wait(&queue_cond_, &queue_lock_);
+  flush_ = false;
+}
+
+void DrmCommitWorker::WakeLocked() {
+  pthread_cond_broadcast(&queue_cond_);
+  uint64_t value = 1;
+  if (write(wake_fd_.get(), &value, sizeof(value)) < 0)
+    ALOGE("Failed to wake commit worker %d", -errno);
+}
+
+int DrmCommitWorker::WaitLocked(AutoLock *lock,
+                                const std::vector<UniqueFd> &fences,
+                                int64_t deadline_ns) {
+  // Deadlines are held to much less than the millisecond epoll_wait offers
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  if (deadline_ns >= 0) {
+    its.it_value.tv_sec = deadline_ns / kBillion;
+    its.it_value.tv_nsec = deadline_ns % kBillion;
+    // A zero it_value would disarm the timer instead
+    if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+      its.it_value.tv_nsec = 1;
+  }
+  if (timerfd_settime(timer_fd_.get(), TFD_TIMER_ABSTIME, &its, NULL))
+    ALOGE("Failed to arm commit timer %d", -errno);
+
+  for (const UniqueFd &fence : fences)
+    AddToEpoll(epoll_fd_.get(), fence.get());
+  lock->Unlock();
+
+  bool timed_out = false;
+  struct epoll_event events[kMaxEvents];
+  int count = epoll_wait(epoll_fd_.get(), events, kMaxEvents, -1);
+  for (int i = 0; i < count; ++i) {
+    uint64_t value;
+    if (events[i].data.fd == timer_fd_.get())
+      timed_out = read(timer_fd_.get(), &value, sizeof(value)) > 0;
+    else if (events[i].data.fd == wake_fd_.get())
+      read(wake_fd_.get(), &value, sizeof(value));
+  }
+  if (count < 0 && errno != EINTR)
+    ALOGE("Failed to wait for commit worker events %d", -errno);
+
+  // The fences are duplicates owned by the caller, so they're still there to
+  // be removed
+  for (const UniqueFd &fence : fences)
+    epoll_ctl(epoll_fd_.get(), EPOLL_CTL_DEL, fence.get(), NULL);
+  if (timed_out && deadline_ns >= 0)
+    RecordWakeLatency(GetTimeNs() - deadline_ns);
+  int ret = lock->Lock();
+  if (ret)
+    return ret;
+  return timed_out ? -ETIMEDOUT : 0;
+}
+
+int DrmCommitWorker::WaitForProducersLocked(
+    AutoLock *lock, DrmDisplayComposition *composition) {
+  int64_t give_up_ns =
+      GetTimeNs() + kAcquireWaitTries * kAcquireWaitTimeoutMs * kMillion;
+  while (!exiting_) {
+    std::vector<UniqueFd> fences;
+    GetPendingFences(composition, false, &fences);
+    if (fences.empty())
+      return 0;
+
+    int64_t now_ns = GetTimeNs();
+    if (now_ns >= give_up_ns)
+      return -ETIMEDOUT;
+    int ret = WaitLocked(
+        lock, fences,
+        std::min(give_up_ns, now_ns + kAcquireWaitTimeoutMs * kMillion));
+    if (ret == -ETIMEDOUT)
+      ALOGW("Still waiting for acquire fences of display frame");
+    else if (ret)
+      return ret;
+  }
+  return -EINTR;
+}
+
+int DrmCommitWorker::CommitLateLayersLocked(AutoLock *lock) {
+  int64_t target_ns = -1;
+  int64_t commit_ns = -1;
+  late_layers_active_ = true;
+  while (late_layers_pending_ && queue_.empty() && !exiting_) {
+    // queue_lock_ is never held while calling into the compositor
+    std::vector<UniqueFd> fences;
+    lock->Unlock();
+    bool late = compositor_->GetLateFences(&fences);
+    int ret = lock->Lock();
+    if (ret)
+      return ret;
+    if (!late || !late_layers_pending_ || !queue_.empty() || exiting_)
+      break;
+
+    // The late buffers go for the first vblank after the frame that stood in
+    // for them, like a frame of their own
+    int64_t now_ns = GetTimeNs();
+    if (fences.empty() && commit_ns < 0) {
+      commit_ns = now_ns;
+      if (enabled_ && model_ && !flush_)
+        commit_ns = timing_->GetCommitTime(*model_, now_ns, &target_ns);
+    }
+    if (fences.empty() && (flush_ || now_ns >= commit_ns)) {
+      committing_ = true;
+      lock->Unlock();
+
+      int64_t start_ns = GetTimeNs();
+      std::unique_ptr<DrmEventHandler> latch_handler(
+          new LatchHandler(timing_, target_ns, start_ns));
+      if (!compositor_->CommitLateLayers(std::move(latch_handler)))
+        timing_->RecordCommit(GetTimeNs() - start_ns);
+
+      ret = lock->Lock();
+      if (ret)
+        return ret;
+      committing_ = false;
+      break;
+    }
+
+    ret = WaitLocked(lock, fences, fences.empty() ? commit_ns : -1);
+    if (ret && ret != -ETIMEDOUT) {
+      late_layers_active_ = false;
+      pthread_cond_broadcast(&queue_cond_);
+      return ret;
+    }
+  }
+  // A frame queued meanwhile brings the late buffers along anyway
+  late_layers_pending_ = false;
+  late_layers_active_ = false;
+  pthread_cond_broadcast(&queue_cond_);
+  return 0;
+}
+
+void DrmCommitWorker::Routine() {
+  AutoLock lock(&queue_lock_, "drm-commit");
+  int ret = lock.Lock();
+  if (ret) {
+    ALOGE("Failed to lock worker, %d", ret);
+    return;
+  }
+
+  if (late_layers_pending_ && CommitLateLayersLocked(&lock))
+    return;
+  while (queue_.empty() && !exiting_)
+    WaitLocked(&lock, std::vector<UniqueFd>(), -1);
+  if (exiting_)
+    return;
+
+  int64_t target_ns = -1;
+  int64_t commit_ns = GetTimeNs();
+  if (enabled_ && model_ && !flush_)
+    commit_ns = timing_->GetCommitTime(*model_, commit_ns, &target_ns);
+
+  // The frame goes once its deadline passed and its producers are done, which
+  // is waited for together. In mailbox mode it may be replaced meanwhile.
+  DrmDisplayComposition *waiting = NULL;
+  bool producers_pending = false;
+  int64_t ready_ns = -1;
+  int64_t give_up_ns = -1;
+  bool fences_timed_out = false;
+  bool substitute = false;
+  while (!exiting_) {
+    if (queue_.front().composition.get() != waiting) {
+      waiting = queue_.front().composition.get();
+      producers_pending = false;
+      ready_ns = -1;
+    }
+
+    std::vector<UniqueFd> fences;
+    GetPendingFences(waiting, false, &fences);
+    int64_t now_ns = GetTimeNs();
+    if (!fences.empty())
+      producers_pending = true;
+    else if (ready_ns < 0)
+      ready_ns = now_ns;
+    bool due = flush_ || now_ns >= commit_ns;
+
+    // Layers that would make the frame miss its vblank can be left for the
+    // next one, as long as nothing else is late
+    if (due && !flush_ && target_ns >= 0 && substitute_late_) {
+      std::vector<UniqueFd> other_fences;
+      GetPendingFences(waiting, true, &other_fences);
+      if (other_fences.empty() && HasLateLayers(waiting)) {
+        substitute = true;
+        break;
+      }
+    }
+    if (fences.empty() && due)
+      break;
+
+    int64_t deadline_ns = commit_ns;
+    if (due) {
+      if (give_up_ns < 0)
+        give_up_ns =
+            now_ns + kAcquireWaitTries * kAcquireWaitTimeoutMs * kMillion;
+      if (now_ns >= give_up_ns) {
+        ALOGE("Gave up waiting for acquire fences of display frame");
+        fences_timed_out = true;
+        break;
+      }
+      deadline_ns =
+          std::min(give_up_ns, now_ns + kAcquireWaitTimeoutMs * kMillion);
+    }
+
+    ret = WaitLocked(&lock, fences, deadline_ns);
+    if (ret == -ETIMEDOUT && due)
+      ALOGW("Still waiting for acquire fences of display frame");
+    else if (ret && ret != -ETIMEDOUT)
+      return;
+  }
+  if (exiting_)
+    return;
+
+  std::unique_ptr<DrmDisplayComposition> composition =
+      std::move(queue_.front().composition);
+  int64_t queued_ns = queue_.front().queued_ns;
+  bool prepared = queue_.front().prepared;
+  queue_.pop_front();
+  committing_ = true;
+
+  int64_t start_ns = GetTimeNs();
+  int64_t hold_ns = start_ns - queued_ns;
+  dump_frames_++;
+  dump_hold_total_ns_ += hold_ns;
+  dump_hold_max_ns_ = std::max(dump_hold_max_ns_, hold_ns);
+
+  // How long the frame waited for its producers, from when it was queued
+  if (producers_pending) {
+    if (ready_ns < 0)
+      ready_ns = start_ns;
+    int64_t producer_wait_ns = ready_ns - queued_ns;
+    dump_producer_waits_++;
+    dump_producer_wait_total_ns_ += producer_wait_ns;
+    dump_producer_wait_max_ns_ =
+        std::max(dump_producer_wait_max_ns_, producer_wait_ns);
+    // Missing the target because of late producers says nothing about the
+    // margin
+    if (ready_ns > commit_ns && !substitute) {
+      dump_producer_late_++;
+      target_ns = -1;
+    }
+  }
+  if (fences_timed_out)
+    dump_acquire_timeouts_++;
+  lock.Unlock();
+
+  // Frames queued unprepared are prepared right before their commit, which
+  // makes preparing them part of the commit cost
+  ret = fences_timed_out ? -ETIMEDOUT : 0;
+  if (!ret && !prepared) {
+    ret = compositor_->PrepareComposition(composition.get());
+    if (ret)
+      composition.reset();
+  }
+  size_t substituted = 0;
+  if (composition && !ret && substitute) {
+    substituted = compositor_->SubstituteLateLayers(composition.get());
+    if (!substituted)
+      ALOGW("No late layer of display frame could be substituted");
+  }
+  if (composition && !ret && (!prepared || substitute)) {
+    // Pre-composition only started now, and may be scanned out by a plane
+    // that can't wait for it either. So may late layers nothing could stand
+    // in for.
+    if (!lock.Lock()) {
+      ret = WaitForProducersLocked(&lock, composition.get());
+      lock.Unlock();
+    }
+  }
+  if (composition) {
+    // Failing here disables the display, as any failed commit does
+    std::unique_ptr<DrmEventHandler> latch_handler(
+        new LatchHandler(timing_, target_ns, start_ns));
+    compositor_->ApplyFrame(std::move(composition), ret,
+                            std::move(latch_handler));
+    if (!ret)
+      timing_->RecordCommit(GetTimeNs() - start_ns);
+  }
+
+  if (lock.Lock())
+    return;
+  committing_ = false;
+  late_layers_pending_ = substituted > 0;
+  pthread_cond_broadcast(&queue_cond_);
+}
+
+void DrmCommitWorker::Dump(std::ostringstream *out) const {
+  AutoLock lock(&queue_lock_, "drm-commit");
+  if (lock.Lock())
+    return;
+
+  *out << "----Commit worker jit=" << enabled_
+       << " mode=" << (mailbox_ ? "mailbox" : "fifo")
+       << " locked=" << (model_ && model_->locked()) << " frames=" << dump_frames_
+       << " flushed=" << dump_flushed_ << " dropped=" << dump_dropped_
+       << " queued=" << queue_.size() << " queue_max=" << dump_queue_max_;
+  if (dump_frames_)
+    *out << " hold_avg_us="
+         << dump_hold_total_ns_ / (int64_t)dump_frames_ / 1000
+         << " hold_max_us=" << dump_hold_max_ns_ / 1000;
+  *out << " producer_waits=" << dump_producer_waits_
+       << " producer_late=" << dump_producer_late_
+       << " acquire_timeouts=" << dump_acquire_timeouts_;
+  if (dump_producer_waits_)
+    *out << " producer_wait_avg_us="
+         << dump_producer_wait_total_ns_ / (int64_t)dump_producer_waits_ / 1000
+         << " producer_wait_max_us=" << dump_producer_wait_max_ns_ / 1000;
+  *out << "\n";
+  lock.Unlock();
+
+  DumpScheduling(out);
+  if (timing_)
+    timing_->Dump(out);
+}
+}
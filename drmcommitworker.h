@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_COMMIT_WORKER_H_
+#define ANDROID_DRM_COMMIT_WORKER_H_
+
+#include "autofd.h"
+#include "vsyncmodel.h"
+#include "worker.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+namespace android {
+
+class AutoLock;
+class DrmDisplayComposition;
+class DrmDisplayCompositor;
+
+// How long commits of a display's crtc take and when their frames actually
+// reach the screen, which decides when the next frame has to be committed.
+// Latch times are reported on the event listener thread, hence the lock.
+class CommitTiming {
+ public:
+  CommitTiming(int64_t min_margin_ns);
+  ~CommitTiming();
+
+  // When a frame ready at now_ns should be committed, with the vblank it's
+  // meant for in target_ns. That's now_ns and -1 unless the model is locked.
+  int64_t GetCommitTime(const VSyncModel &model, int64_t now_ns,
+                        int64_t *target_ns);
+  void RecordCommit(int64_t duration_ns);
+  // A frame committed at commit_ns for the vblank at target_ns was latched at
+  // latch_ns. Frames latched late make the margin grow, frames on time let it
+  // shrink back towards the minimum.
+  void RecordLatch(int64_t target_ns, int64_t commit_ns, int64_t latch_ns);
+
+  void Dump(std::ostringstream *out) const;
+
+ private:
+  static const int kCostAverageShift = 3;
+  static const int kMarginDecayShift = 5;
+
+  mutable pthread_mutex_t lock_;
+  int64_t min_margin_ns_;
+  int64_t margin_ns_;
+  int64_t commit_cost_ns_;
+  int64_t period_ns_;
+  int64_t last_target_ns_;
+
+  // Not reset by Dump()
+  uint64_t dump_latches_;
+  uint64_t dump_misses_;
+  int64_t dump_last_target_ns_;
+  int64_t dump_last_latch_ns_;
+  int64_t dump_latch_offset_total_ns_;
+  int64_t dump_latch_offset_max_ns_;
+  int64_t dump_commit_to_latch_total_ns_;
+};
+
+// Commits the frames of a display compositor on a thread of its own, each
+// just before the vblank it's meant for, so the content reaching the screen
+// is as fresh as it can be without missing that vblank. Frames are committed
+// in the order they were queued. Queueing one never waits for the frames ahead
+// of it, producers are held back by the retire and release fences instead.
+//
+// Planes without IN_FENCE_FD can't wait for the buffers they scan out, so
+// frames aren't committed before the acquire fences of their layers signaled,
+// which the worker waits for along with the deadline. Once the deadline
+// passed, layers with planes of their own that are still waiting for their
+// buffer show the previous one instead, unless hwc.drm.substitute_late is 0.
+// Their own buffer follows in a commit of its own once it's ready, unless
+// another frame was queued by then.
+class DrmCommitWorker : public Worker {
+ public:
+  DrmCommitWorker(DrmDisplayCompositor *compositor);
+  ~DrmCommitWorker() override;
+
+  int Init();
+  void SetVSyncModel(std::shared_ptr<const VSyncModel> model);
+
+  // Whether frames should be queued unprepared, in mailbox mode. Set by
+  // hwc.drm.present_mode, which may change at any time. Frames queued in the
+  // previous mode are committed before this returns.
+  bool UpdateMailbox();
+
+  // In mailbox mode, a new frame replaces the last one queued as long as that
+  // was queued unprepared and doesn't render the squash framebuffer, which
+  // later frames rely on. The replaced frame is dropped without ever being
+  // prepared or committed.
+  int QueueFrame(std::unique_ptr<DrmDisplayComposition> composition,
+                 bool prepared);
+  // Commits the queued frame without waiting for its vblank, and returns once
+  // the compositor is done with it
+  void Flush();
+
+  void Dump(std::ostringstream *out) const;
+
+ protected:
+  void Routine() override;
+
+ private:
+  // We'll wait for acquire fences to fire for kAcquireWaitTimeoutMs,
+  // kAcquireWaitTries times, logging a warning in between.
+  static const int kAcquireWaitTries = 5;
+  static const int kAcquireWaitTimeoutMs = 100;
+
+  static const int kMaxEvents = 4;
+
+  struct QueuedFrame {
+    std::unique_ptr<DrmDisplayComposition> composition;
+    int64_t queued_ns;
+    bool prepared;
+  };
+
+  bool CanReplaceLastLocked() const;
+  void FlushLocked();
+  void WakeLocked();
+  // Waits until one of fences signals, deadline_ns passes or the worker is
+  // woken up, with queue_lock_ released meanwhile. -1 waits without deadline.
+  // Returns -ETIMEDOUT if the deadline passed.
+  int WaitLocked(AutoLock *lock, const std::vector<UniqueFd> &fences,
+                 int64_t deadline_ns);
+  int WaitForProducersLocked(AutoLock *lock,
+                             DrmDisplayComposition *composition);
+  // Commits the buffers of the late layers the last frame substituted once
+  // they're ready, unless a frame is queued first
+  int CommitLateLayersLocked(AutoLock *lock);
+
+  DrmDisplayCompositor *compositor_;
+  std::shared_ptr<CommitTiming> timing_;
+  bool enabled_;
+  bool substitute_late_;
+
+  // The thread waits for fences, its deadline and being woken up with epoll
+  UniqueFd epoll_fd_;
+  UniqueFd wake_fd_;
+  UniqueFd timer_fd_;
+
+  mutable pthread_mutex_t queue_lock_;
+  pthread_cond_t queue_cond_;
+  std::shared_ptr<const VSyncModel> model_;
+  std::deque<QueuedFrame> queue_;
+  bool mailbox_;
+  bool committing_;
+  bool late_layers_pending_;
+  // Set while CommitLateLayersLocked runs, which releases queue_lock_
+  bool late_layers_active_;
+  bool flush_;
+  bool exiting_;
+
+  // Not reset by Dump(), protected by queue_lock_
+  uint64_t dump_frames_;
+  uint64_t dump_flushed_;
+  uint64_t dump_dropped_;
+  size_t dump_queue_max_;
+  int64_t dump_hold_total_ns_;
+  int64_t dump_hold_max_ns_;
+  uint64_t dump_producer_waits_;
+  uint64_t dump_producer_late_;
+  uint64_t dump_acquire_timeouts_;
+  int64_t dump_producer_wait_total_ns_;
+  int64_t dump_producer_wait_max_ns_;
+};
+}
+
+#endif  // ANDROID_DRM_COMMIT_WORKER_H_
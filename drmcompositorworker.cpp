@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-drm-compositor-worker"
+
+#include "drmcompositorworker.h"
+#include "drmdisplaycompositor.h"
+
+#include <errno.h>
+
+#include <cutils/log.h>
+#include <system/thread_defs.h>
+
+namespace android {
+
+DrmCompositorWorker::DrmCompositorWorker(DrmDisplayCompositor *compositor)
+    : Worker("drm-compositor", ANDROID_PRIORITY_BACKGROUND),
+      compositor_(compositor),
+      prewarm_(false) {
+}
+
+DrmCompositorWorker::~DrmCompositorWorker() {
+  if (initialized())
+    Exit();
+}
+
+int DrmCompositorWorker::Init() {
+  return InitWorker();
+}
+
+int DrmCompositorWorker::QueuePrewarm() {
+  int ret = Lock();
+  if (ret) {
+    ALOGE("Failed to lock worker, %d", ret);
+    return ret;
+  }
+
+  prewarm_ = true;
+  SignalLocked();
+  return Unlock();
+}
+
+void DrmCompositorWorker::Routine() {
+  int ret = Lock();
+  if (ret) {
+    ALOGE("Failed to lock worker, %d", ret);
+    return;
+  }
+
+  bool prewarm = prewarm_;
+  prewarm_ = false;
+
+  int wait_ret = 0;
+  if (!prewarm)
+    wait_ret =
+        WaitForSignalOrExitLocked(compositor_->GetFramebufferTrimDelayNs());
+
+  ret = Unlock();
+  if (ret) {
+    ALOGE("Failed to unlock worker, %d", ret);
+    return;
+  }
+
+  if (prewarm) {
+    compositor_->Prewarm();
+  } else if (wait_ret == -EINTR) {
+    return;
+  } else if (wait_ret == -ETIMEDOUT) {
+    compositor_->TrimIdleFramebuffers();
+  } else if (wait_ret) {
+    ALOGE("Failed to wait for signal, %d", wait_ret);
+  }
+}
+}
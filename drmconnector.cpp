@@ -33,6 +33,7 @@ DrmConnector::DrmConnector(DrmResources *drm, drmModeConnectorPtr c,
     : drm_(drm),
       id_(c->connector_id),
       encoder_(current_encoder),
+      probed_encoder_id_(c->encoder_id),
       display_(-1),
       type_(c->connector_type),
       state_(c->connection),
@@ -131,6 +132,10 @@ void DrmConnector::set_encoder(DrmEncoder *encoder) {
   encoder_ = encoder;
 }
 
+uint32_t DrmConnector::probed_encoder_id() const {
+  return probed_encoder_id_;
+}
+
 drmModeConnection DrmConnector::state() const {
   return state_;
 }
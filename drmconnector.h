@@ -62,6 +62,9 @@ class DrmConnector {
   }
   DrmEncoder *encoder() const;
   void set_encoder(DrmEncoder *encoder);
+  // The encoder the kernel had the connector routed to when it was probed, 0
+  // if none. Unlike encoder(), it stays put when a display pipe is picked.
+  uint32_t probed_encoder_id() const;
 
   drmModeConnection state() const;
 
@@ -73,6 +76,7 @@ class DrmConnector {
 
   uint32_t id_;
   DrmEncoder *encoder_;
+  uint32_t probed_encoder_id_;
   int display_;
 
   uint32_t type_;
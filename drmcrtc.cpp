@@ -80,6 +80,14 @@ bool DrmCrtc::can_bind(int display) const {
   return display_ == -1 || display_ == display;
 }
 
+bool DrmCrtc::mode_valid() const {
+  return mode_valid_;
+}
+
+const DrmMode &DrmCrtc::mode() const {
+  return mode_;
+}
+
 const DrmProperty &DrmCrtc::active_property() const {
   return active_property_;
 }
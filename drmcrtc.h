@@ -43,6 +43,10 @@ class DrmCrtc {
 
   bool can_bind(int display) const;
 
+  // The mode the crtc was scanning out when probed, as the bootloader left it
+  bool mode_valid() const;
+  const DrmMode &mode() const;
+
   const DrmProperty &active_property() const;
   const DrmProperty &mode_property() const;
   const DrmProperty &out_fence_ptr_property() const;
@@ -23,23 +23,25 @@
 #include "drmresources.h"
 #include "platform.h"
 
+#include <errno.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <unordered_set>
 
 #include <cutils/log.h>
-#include <sw_sync.h>
 #include <sync/sync.h>
 #include <xf86drmMode.h>
 
 namespace android {
 
 DrmDisplayComposition::~DrmDisplayComposition() {
-  if (timeline_fd_ >= 0) {
-    SignalCompositionDone();
-    close(timeline_fd_);
-  }
+  // Points are signaled again in case the composition never got to a stage,
+  // which is harmless for those that did
+  SignalSquashDone();
+  SignalPreCompDone();
+  SignalCompositionDone();
 }
 
 int DrmDisplayComposition::Init(DrmResources *drm, DrmCrtc *crtc,
@@ -51,12 +53,12 @@ int DrmDisplayComposition::Init(DrmResources *drm, DrmCrtc *crtc,
   planner_ = planner;
   frame_no_ = frame_no;
 
-  int ret = sw_sync_timeline_create();
-  if (ret < 0) {
-    ALOGE("Failed to create sw sync timeline %d", ret);
-    return ret;
+  if (!render_timeline_ || !display_timeline_) {
+    ALOGE("Failed to init composition without sync timelines");
+    return -ENODEV;
   }
-  timeline_fd_ = ret;
+  composition_done_point_ = display_timeline_->ReservePoint();
+  points_reserved_ = true;
   return 0;
 }
 
@@ -64,24 +66,28 @@ bool DrmDisplayComposition::validate_composition_type(DrmCompositionType des) {
   return type_ == DRM_COMPOSITION_TYPE_EMPTY || type_ == des;
 }
 
-int DrmDisplayComposition::CreateNextTimelineFence() {
-  ++timeline_;
-  return sw_sync_fence_create(timeline_fd_, "hwc drm display composition fence",
-                              timeline_);
+int DrmDisplayComposition::CreateCompositionDoneFence() {
+  if (!points_reserved_)
+    return -ENODEV;
+  return DupStageFence(display_timeline_.get(), composition_done_point_,
+                       &composition_done_fence_);
 }
 
-int DrmDisplayComposition::IncreaseTimelineToPoint(int point) {
-  int timeline_increase = point - timeline_current_;
-  if (timeline_increase <= 0)
-    return 0;
-
-  int ret = sw_sync_timeline_inc(timeline_fd_, timeline_increase);
-  if (ret)
-    ALOGE("Failed to increment sync timeline %d", ret);
-  else
-    timeline_current_ = point;
+int DrmDisplayComposition::DupStageFence(SyncTimeline *timeline,
+                                         uint32_t point,
+                                         UniqueFd *stage_fence) {
+  if (stage_fence->get() < 0) {
+    int ret = stage_fence->Set(timeline->CreateFence(point));
+    if (ret < 0)
+      return ret;
+  }
 
-  return ret;
+  int fd = dup(stage_fence->get());
+  if (fd < 0) {
+    ALOGE("Failed to dup stage fence %d", errno);
+    return -errno;
+  }
+  return fd;
 }
 
 int DrmDisplayComposition::SetLayers(DrmHwcLayer *layers, size_t num_layers,
@@ -91,6 +97,9 @@ int DrmDisplayComposition::SetLayers(DrmHwcLayer *layers, size_t num_layers,
 
   geometry_changed_ = geometry_changed;
 
+  // Leave room for the squash and precomp framebuffer layers. They are added
+  // while the GL compositor may be reading layers_, which must not move.
+  layers_.reserve(num_layers + 2);
   for (size_t layer_index = 0; layer_index < num_layers; layer_index++) {
     layers_.emplace_back(std::move(layers[layer_index]));
   }
@@ -255,30 +264,43 @@ int DrmDisplayComposition::CreateAndAssignReleaseFences() {
     }
   }
 
+  if (!points_reserved_)
+    return -ENODEV;
+
+  // The GL compositor squashes before it pre-composites
+  if (!squash_regions_.empty() && !squash_point_reserved_) {
+    squash_done_point_ = render_timeline_->ReservePoint();
+    squash_point_reserved_ = true;
+  }
+  if (!pre_comp_regions_.empty() && !pre_comp_point_reserved_) {
+    pre_comp_done_point_ = render_timeline_->ReservePoint();
+    pre_comp_point_reserved_ = true;
+  }
+
   for (DrmHwcLayer *layer : squash_layers) {
     if (!layer->release_fence)
       continue;
-    int ret = layer->release_fence.Set(CreateNextTimelineFence());
+    int ret = layer->release_fence.Set(DupStageFence(
+        render_timeline_.get(), squash_done_point_, &squash_done_fence_));
     if (ret < 0) {
       ALOGE("Failed to set the release fence (squash) %d", ret);
       return ret;
     }
   }
-  timeline_squash_done_ = timeline_;
 
   for (DrmHwcLayer *layer : pre_comp_layers) {
     if (!layer->release_fence)
       continue;
-    int ret = layer->release_fence.Set(CreateNextTimelineFence());
+    int ret = layer->release_fence.Set(DupStageFence(
+        render_timeline_.get(), pre_comp_done_point_, &pre_comp_done_fence_));
     if (ret < 0)
       return ret;
   }
-  timeline_pre_comp_done_ = timeline_;
 
   for (DrmHwcLayer *layer : comp_layers) {
     if (!layer->release_fence)
       continue;
-    int ret = layer->release_fence.Set(CreateNextTimelineFence());
+    int ret = layer->release_fence.Set(CreateCompositionDoneFence());
     if (ret < 0) {
       ALOGE("Failed to set the release fence (comp) %d", ret);
       return ret;
@@ -409,6 +431,32 @@ int DrmDisplayComposition::FinalizeComposition(DrmHwcRect<int> *exclude_rects,
   return CreateAndAssignReleaseFences();
 }
 
+void DrmDisplayComposition::SubstituteLayer(size_t index,
+                                            DrmHwcLayer &&stand_in) {
+  late_layers_.push_back({index, std::move(stand_in)});
+  std::swap(layers_[index], late_layers_.back().layer);
+}
+
+void DrmDisplayComposition::GetLateFences(std::vector<UniqueFd> *fences) const {
+  if (late_layers_restored_)
+    return;
+
+  for (const LateLayer &late : late_layers_) {
+    int fence = late.layer.acquire_fence.get();
+    if (fence >= 0 && sync_wait(fence, 0) != 0)
+      fences->emplace_back(dup(fence));
+  }
+}
+
+void DrmDisplayComposition::RestoreLateLayers() {
+  if (late_layers_restored_)
+    return;
+
+  for (LateLayer &late : late_layers_)
+    std::swap(layers_[late.index], late.layer);
+  late_layers_restored_ = true;
+}
+
 static const char *DrmCompositionTypeToString(DrmCompositionType type) {
   switch (type) {
     case DRM_COMPOSITION_TYPE_EMPTY:
@@ -540,9 +588,21 @@ void DrmDisplayComposition::Dump(std::ostringstream *out) const {
       break;
   }
 
-  *out << " timeline[current/squash/pre-comp/done]=" << timeline_current_ << "/"
-       << timeline_squash_done_ << "/" << timeline_pre_comp_done_ << "/"
-       << timeline_ << "\n";
+  *out << " points[squash/pre-comp/done]=";
+  if (squash_point_reserved_)
+    *out << squash_done_point_;
+  else
+    *out << "-";
+  *out << "/";
+  if (pre_comp_point_reserved_)
+    *out << pre_comp_done_point_;
+  else
+    *out << "-";
+  *out << "/" << composition_done_point_;
+  if (!late_layers_.empty())
+    *out << " substituted_layers=" << late_layers_.size()
+         << (late_layers_restored_ ? " (restored)" : "");
+  *out << "\n";
 
   *out << "    Layers: count=" << layers_.size() << "\n";
   for (size_t i = 0; i < layers_.size(); i++) {
@@ -21,7 +21,9 @@
 #include "drmhwcomposer.h"
 #include "drmplane.h"
 #include "glworker.h"
+#include "synctimeline.h"
 
+#include <memory>
 #include <sstream>
 #include <vector>
 
@@ -117,7 +119,13 @@ class DrmCompositionPlane {
 
 class DrmDisplayComposition {
  public:
-  DrmDisplayComposition() = default;
+  // Layers composited by the GL compositor are released on render_timeline,
+  // everything else once the composition leaves the screen on
+  // display_timeline
+  DrmDisplayComposition(std::shared_ptr<SyncTimeline> render_timeline,
+                        std::shared_ptr<SyncTimeline> display_timeline)
+      : render_timeline_(render_timeline), display_timeline_(display_timeline) {
+  }
   DrmDisplayComposition(const DrmDisplayComposition &) = delete;
   ~DrmDisplayComposition();
 
@@ -136,15 +144,33 @@ class DrmDisplayComposition {
 
   int FinalizeComposition();
 
-  int CreateNextTimelineFence();
-  int SignalSquashDone() {
-    return IncreaseTimelineToPoint(timeline_squash_done_);
+  // Returns a fence that signals once the composition is done on the screen,
+  // for framebuffers it shows to be released with
+  int CreateCompositionDoneFence();
+  void SignalSquashDone() {
+    if (squash_point_reserved_ && !squash_point_taken_)
+      render_timeline_->Signal(squash_done_point_);
+  }
+  void SignalPreCompDone() {
+    if (pre_comp_point_reserved_ && !pre_comp_point_taken_)
+      render_timeline_->Signal(pre_comp_done_point_);
   }
-  int SignalPreCompDone() {
-    return IncreaseTimelineToPoint(timeline_pre_comp_done_);
+  void SignalCompositionDone() {
+    if (points_reserved_)
+      display_timeline_->Signal(composition_done_point_);
   }
-  int SignalCompositionDone() {
-    return IncreaseTimelineToPoint(timeline_);
+  // Hands the render timeline point of the squash or precomp stage over to
+  // whatever releases the stage's layers once the GPU is done with them, which
+  // may be after the composition is gone. The composition doesn't signal it
+  // from then on. Returns false if the stage has no point.
+  bool TakeStagePoint(bool squash, std::shared_ptr<SyncTimeline> *timeline,
+                      uint32_t *point) {
+    if (!(squash ? squash_point_reserved_ : pre_comp_point_reserved_))
+      return false;
+    (squash ? squash_point_taken_ : pre_comp_point_taken_) = true;
+    *timeline = render_timeline_;
+    *point = squash ? squash_done_point_ : pre_comp_done_point_;
+    return true;
   }
 
   std::vector<DrmHwcLayer> &layers() {
@@ -195,6 +221,33 @@ class DrmDisplayComposition {
     return planner_;
   }
 
+  // Layers scanning out the buffer of the previous composition in their
+  // place, because theirs wasn't ready in time
+  size_t substituted_layers() const {
+    return late_layers_.size();
+  }
+  // Puts stand_in in place of the layer at index, which is set aside with its
+  // acquire fence until RestoreLateLayers
+  void SubstituteLayer(size_t index, DrmHwcLayer &&stand_in);
+  // Whether layers were set aside that haven't been restored yet
+  bool has_late_layers() const {
+    return !late_layers_.empty() && !late_layers_restored_;
+  }
+  // Duplicates the acquire fences of the layers set aside which haven't
+  // signaled yet
+  void GetLateFences(std::vector<UniqueFd> *fences) const;
+  // Swaps the layers set aside back in. The stand-ins are kept until the
+  // composition is done, as the display may still be scanning them out.
+  void RestoreLateLayers();
+  // A composition scanning out buffers of the previous one keeps it until
+  // it's done itself, so their release fences don't signal too early
+  bool holds_previous() const {
+    return previous_ != NULL;
+  }
+  void HoldPrevious(std::unique_ptr<DrmDisplayComposition> previous) {
+    previous_ = std::move(previous);
+  }
+
   int take_out_fence() {
     return out_fence_.Release();
   }
@@ -208,7 +261,8 @@ class DrmDisplayComposition {
  private:
   bool validate_composition_type(DrmCompositionType desired);
 
-  int IncreaseTimelineToPoint(int point);
+  int DupStageFence(SyncTimeline *timeline, uint32_t point,
+                    UniqueFd *stage_fence);
 
   int FinalizeComposition(DrmHwcRect<int> *exclude_rects,
                           size_t num_exclude_rects);
@@ -224,11 +278,23 @@ class DrmDisplayComposition {
   uint32_t dpms_mode_ = DRM_MODE_DPMS_ON;
   DrmMode display_mode_;
 
-  int timeline_fd_ = -1;
-  int timeline_ = 0;
-  int timeline_current_ = 0;
-  int timeline_squash_done_ = 0;
-  int timeline_pre_comp_done_ = 0;
+  // Every layer released at the same stage gets a dup of the same fence
+  std::shared_ptr<SyncTimeline> render_timeline_;
+  std::shared_ptr<SyncTimeline> display_timeline_;
+  // The render points are only reserved for the stages the composition has
+  // regions for. A point nothing would ever signal before the composition is
+  // destroyed holds up every later one on the timeline.
+  bool points_reserved_ = false;
+  bool squash_point_reserved_ = false;
+  bool pre_comp_point_reserved_ = false;
+  bool squash_point_taken_ = false;
+  bool pre_comp_point_taken_ = false;
+  uint32_t squash_done_point_ = 0;
+  uint32_t pre_comp_done_point_ = 0;
+  uint32_t composition_done_point_ = 0;
+  UniqueFd squash_done_fence_;
+  UniqueFd pre_comp_done_fence_;
+  UniqueFd composition_done_fence_;
   UniqueFd out_fence_ = -1;
 
   bool geometry_changed_;
@@ -238,6 +304,14 @@ class DrmDisplayComposition {
   std::vector<DrmCompositionPlane> composition_planes_;
 
   uint64_t frame_no_ = 0;
+
+  struct LateLayer {
+    size_t index;
+    DrmHwcLayer layer;
+  };
+  std::vector<LateLayer> late_layers_;
+  bool late_layers_restored_ = false;
+  std::unique_ptr<DrmDisplayComposition> previous_;
 };
 }
 
@@ -19,23 +19,31 @@
 
 #include "drmdisplaycompositor.h"
 
+#include <inttypes.h>
+#include <math.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdlib.h>
 #include <time.h>
+#include <algorithm>
 #include <sstream>
 #include <vector>
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
+#include <drm/drm_fourcc.h>
 #include <drm/drm_mode.h>
 #include <sync/sync.h>
+#include <ui/PixelFormat.h>
 #include <utils/Trace.h>
 
 #include "autolock.h"
+#include "drmcommitworker.h"
+#include "drmcompositorworker.h"
 #include "drmcrtc.h"
 #include "drmplane.h"
 #include "drmresources.h"
-#include "glworker.h"
+#include "glcompositorworker.h"
 
 namespace android {
 
@@ -139,6 +147,11 @@ bool SquashState::RecordAndCompareSquashed(
   return changed;
 }
 
+void SquashState::ForgetSquashed() {
+  for (Region &region : regions_)
+    region.squashed = false;
+}
+
 void SquashState::Dump(std::ostringstream *out) const {
   *out << "----SquashState generation=" << generation_number_
        << " history=" << valid_history_ << "\n"
@@ -167,6 +180,13 @@ void SquashState::Dump(std::ostringstream *out) const {
   }
 }
 
+static int64_t GetTimeNs() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+  return ts.tv_sec * 1000LL * 1000 * 1000 + ts.tv_nsec;
+}
+
 static bool UsesSquash(const std::vector<DrmCompositionPlane> &comp_planes) {
   return std::any_of(comp_planes.begin(), comp_planes.end(),
                      [](const DrmCompositionPlane &plane) {
@@ -181,9 +201,27 @@ DrmDisplayCompositor::DrmDisplayCompositor()
       active_(false),
       use_hw_overlays_(true),
       framebuffer_index_(0),
+      framebuffers_(DRM_DISPLAY_BUFFERS),
       squash_framebuffer_index_(0),
+      framebuffer_idle_timeout_ns_(0),
+      last_framebuffer_use_ns_(0),
+      framebuffers_trimmed_(true),
+      prewarm_width_(0),
+      prewarm_height_(0),
+      prewarm_start_ns_(0),
+      refresh_period_ns_(0),
+      adopt_boot_mode_(false),
+      precomp_downscale_threshold_ns_(0),
+      precomp_downscale_(1.0f),
+      precomp_downscaled_(false),
+      modesets_(0),
+      precomp_scaling_modesets_(0),
       dump_frames_composited_(0),
-      dump_last_timestamp_ns_(0) {
+      dump_last_timestamp_ns_(0),
+      dump_framebuffers_trimmed_(0),
+      dump_framebuffer_ring_grows_(0),
+      dump_framebuffer_stalls_(0),
+      dump_late_layer_commits_(0) {
   struct timespec ts;
   if (clock_gettime(CLOCK_MONOTONIC, &ts))
     return;
@@ -194,15 +232,19 @@ DrmDisplayCompositor::~DrmDisplayCompositor() {
   if (!initialized_)
     return;
 
+  // Stop background work before anything it uses goes away
+  commit_worker_.reset();
+  background_worker_.reset();
+
   int ret = pthread_mutex_lock(&lock_);
   if (ret)
     ALOGE("Failed to acquire compositor lock %d", ret);
 
-  if (mode_.blob_id)
-    drm_->DestroyPropertyBlob(mode_.blob_id);
-  if (mode_.old_blob_id)
-    drm_->DestroyPropertyBlob(mode_.old_blob_id);
+  for (auto &blob : mode_blobs_)
+    drm_->DestroyPropertyBlob(blob.second);
 
+  if (pre_compositor_)
+    pre_compositor_->Finish();
   active_composition_.reset();
 
   ret = pthread_mutex_unlock(&lock_);
@@ -210,6 +252,7 @@ DrmDisplayCompositor::~DrmDisplayCompositor() {
     ALOGE("Failed to acquire compositor lock %d", ret);
 
   pthread_mutex_destroy(&lock_);
+  pthread_mutex_destroy(&framebuffer_lock_);
 }
 
 int DrmDisplayCompositor::Init(DrmResources *drm, int display) {
@@ -221,14 +264,82 @@ int DrmDisplayCompositor::Init(DrmResources *drm, int display) {
     ALOGE("Failed to initialize drm compositor lock %d\n", ret);
     return ret;
   }
+  ret = pthread_mutex_init(&framebuffer_lock_, NULL);
+  if (ret) {
+    ALOGE("Failed to initialize drm compositor framebuffer lock %d\n", ret);
+    pthread_mutex_destroy(&lock_);
+    return ret;
+  }
+
+  render_timeline_.reset(new SyncTimeline("hwc render"));
+  display_timeline_.reset(new SyncTimeline("hwc display"));
+  ret = render_timeline_->Init();
+  if (!ret)
+    ret = display_timeline_->Init();
+  if (ret) {
+    ALOGE("Failed to initialize sync timelines %d", ret);
+    render_timeline_.reset();
+    display_timeline_.reset();
+    pthread_mutex_destroy(&framebuffer_lock_);
+    pthread_mutex_destroy(&lock_);
+    return ret;
+  }
+
+  // Pre-composition switches to a reduced resolution once it takes longer
+  // than hwc.drm.precomp_downscale_ms on average, 0 disables that
+  char threshold_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.precomp_downscale_ms", threshold_opt, "0");
+  precomp_downscale_threshold_ns_ =
+      (int64_t)(atof(threshold_opt) * 1000 * 1000);
+
+  char scale_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.precomp_downscale", scale_opt, "0.75");
+  precomp_downscale_ = atof(scale_opt);
+  if (precomp_downscale_ < kMinPreCompScale || precomp_downscale_ > 1.0f) {
+    ALOGW("Ignoring invalid pre-composition downscale %s", scale_opt);
+    precomp_downscale_ = 1.0f;
+  }
+
+  // Internal framebuffers are released after going unused for
+  // hwc.drm.framebuffer_idle_ms, 0 keeps them until the display turns off
+  char idle_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.framebuffer_idle_ms", idle_opt, "5000");
+  framebuffer_idle_timeout_ns_ = atoll(idle_opt) * 1000 * 1000;
+
+  // The first mode set may keep what the bootloader left on the display,
+  // unless hwc.drm.boot_takeover is 0
+  char takeover_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.boot_takeover", takeover_opt, "1");
+  adopt_boot_mode_ = atoi(takeover_opt) != 0;
+
+  background_worker_.reset(new DrmCompositorWorker(this));
+  ret = background_worker_->Init();
+  if (ret) {
+    ALOGW("Failed to start compositor background worker %d", ret);
+    background_worker_.reset();
+  }
+
+  commit_worker_.reset(new DrmCommitWorker(this));
+  ret = commit_worker_->Init();
+  if (ret) {
+    ALOGW("Failed to start commit worker, committing on queue %d", ret);
+    commit_worker_.reset();
+  }
 
   initialized_ = true;
   return 0;
 }
 
+void DrmDisplayCompositor::SetVSyncModel(
+    std::shared_ptr<const VSyncModel> model) {
+  if (commit_worker_)
+    commit_worker_->SetVSyncModel(std::move(model));
+}
+
 std::unique_ptr<DrmDisplayComposition> DrmDisplayCompositor::CreateComposition()
     const {
-  return std::unique_ptr<DrmDisplayComposition>(new DrmDisplayComposition());
+  return std::unique_ptr<DrmDisplayComposition>(
+      new DrmDisplayComposition(render_timeline_, display_timeline_));
 }
 
 std::tuple<uint32_t, uint32_t, int>
@@ -244,15 +355,331 @@ DrmDisplayCompositor::GetActiveModeResolution() {
   return std::make_tuple(mode.h_display(), mode.v_display(), 0);
 }
 
-int DrmDisplayCompositor::PrepareFramebuffer(
-    DrmFramebuffer &fb, DrmDisplayComposition *display_comp) {
-  int ret = fb.WaitReleased(-1);
-  if (ret) {
-    ALOGE("Failed to wait for framebuffer release %d", ret);
-    return ret;
+static DrmPlane *GetFramebufferPlane(DrmDisplayComposition *display_comp,
+                                     DrmCompositionPlane::Type type) {
+  for (const DrmCompositionPlane &comp_plane :
+       display_comp->composition_planes()) {
+    if (comp_plane.type() == type)
+      return comp_plane.plane();
+  }
+  return NULL;
+}
+
+static std::vector<DrmCompositionRegion> &GetFramebufferRegions(
+    DrmDisplayComposition *display_comp, DrmCompositionPlane::Type type) {
+  return type == DrmCompositionPlane::Type::kSquash
+             ? display_comp->squash_regions()
+             : display_comp->pre_comp_regions();
+}
+
+// Same mapping as the importers, for the formats framebuffers are allocated in
+static uint32_t ConvertHalFormatToDrm(PixelFormat format) {
+  switch (format) {
+    case PIXEL_FORMAT_RGBX_8888:
+      return DRM_FORMAT_XBGR8888;
+    case PIXEL_FORMAT_RGB_565:
+      return DRM_FORMAT_BGR565;
+    default:
+      return DRM_FORMAT_ABGR8888;
   }
-  uint32_t width, height;
-  std::tie(width, height, ret) = GetActiveModeResolution();
+}
+
+static DrmHwcBlending GetFramebufferBlending(const DrmFramebuffer &fb) {
+  if (fb.buffer()->getPixelFormat() == PIXEL_FORMAT_RGBA_8888)
+    return DrmHwcBlending::kPreMult;
+  return DrmHwcBlending::kNone;
+}
+
+void DrmDisplayCompositor::StartPrewarm() {
+  char prewarm_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.prewarm", prewarm_opt, "1");
+  if (!atoi(prewarm_opt) || !background_worker_)
+    return;
+
+  int ret;
+  std::tie(prewarm_width_, prewarm_height_, ret) = GetActiveModeResolution();
+  if (ret)
+    return;
+
+  prewarm_start_ns_ = GetTimeNs();
+  background_worker_->QueuePrewarm();
+}
+
+void DrmDisplayCompositor::Prewarm() {
+  ATRACE_CALL();
+  AutoLock lock(&framebuffer_lock_, "framebuffer");
+  if (lock.Lock())
+    return;
+
+  if (!pre_compositor_) {
+    pre_compositor_.reset(new GLCompositorWorker());
+    pre_compositor_->SetSchedPeriod(refresh_period_ns_.load());
+    int ret = pre_compositor_->InitAsync();
+    if (ret) {
+      ALOGE("Failed to start initializing OpenGL compositor %d", ret);
+      pre_compositor_.reset();
+    }
+  }
+
+  // A full screen buffer is what a precomp region on the primary plane needs.
+  // It's allocated without holding the lock so frames don't wait for it.
+  bool allocate = !framebuffers_[framebuffer_index_].is_valid();
+  lock.Unlock();
+  if (!allocate)
+    return;
+
+  DrmFramebuffer fb;
+  if (!fb.Allocate(prewarm_width_, prewarm_height_)) {
+    ALOGE("Failed to prewarm framebuffer with size %ux%u", prewarm_width_,
+          prewarm_height_);
+    return;
+  }
+
+  if (lock.Lock())
+    return;
+  DrmFramebuffer &target = framebuffers_[framebuffer_index_];
+  if (!target.is_valid())
+    target = std::move(fb);
+  lock.Unlock();
+
+  ALOGI("Prewarmed framebuffer of display %d after %" PRId64 "ms", display_,
+        (GetTimeNs() - prewarm_start_ns_) / (1000 * 1000));
+}
+
+void DrmDisplayCompositor::MarkFramebuffersUsed() {
+  last_framebuffer_use_ns_.store(GetTimeNs(), std::memory_order_relaxed);
+  if (framebuffers_trimmed_.exchange(false) && background_worker_)
+    background_worker_->Signal();
+}
+
+int64_t DrmDisplayCompositor::GetFramebufferTrimDelayNs() const {
+  if (framebuffer_idle_timeout_ns_ <= 0 || framebuffers_trimmed_.load())
+    return -1;
+
+  int64_t idle_ns =
+      GetTimeNs() - last_framebuffer_use_ns_.load(std::memory_order_relaxed);
+  return std::max(framebuffer_idle_timeout_ns_ - idle_ns, (int64_t)1);
+}
+
+void DrmDisplayCompositor::TrimIdleFramebuffers() {
+  AutoLock lock(&framebuffer_lock_, "framebuffer");
+  if (lock.Lock())
+    return;
+
+  // A frame may have come in while waiting for the lock
+  int64_t idle_ns =
+      GetTimeNs() - last_framebuffer_use_ns_.load(std::memory_order_relaxed);
+  if (framebuffers_trimmed_.load() || idle_ns < framebuffer_idle_timeout_ns_)
+    return;
+
+  size_t count = TrimFramebuffers(false);
+  framebuffers_trimmed_.store(true);
+  if (count)
+    ALOGI("Released %zu idle framebuffers of display %d", count, display_);
+}
+
+// Must be called with framebuffer_lock_ held. Only framebuffers that aren't
+// scanned out anymore are released.
+size_t DrmDisplayCompositor::TrimFramebuffers(bool all) {
+  size_t count = 0;
+  auto trim = [&](DrmFramebuffer &fb) {
+    if (!fb.is_valid() || fb.WaitReleased(0))
+      return;
+    fb.Clear();
+    count++;
+  };
+
+  for (DrmFramebuffer &fb : framebuffers_)
+    trim(fb);
+
+  // Slots added while the display held on to buffers go away once empty
+  for (size_t i = framebuffers_.size();
+       i-- > 0 && framebuffers_.size() > DRM_DISPLAY_BUFFERS;) {
+    if (framebuffers_[i].is_valid())
+      continue;
+    framebuffers_.erase(framebuffers_.begin() + i);
+    if ((int)i < framebuffer_index_)
+      framebuffer_index_--;
+  }
+  framebuffer_index_ %= framebuffers_.size();
+
+  // The current squash framebuffer is shown again without being rendered as
+  // long as the squashed regions stay the same, so it can only go along with
+  // the squash state
+  if (all) {
+    for (DrmFramebuffer &fb : squash_framebuffers_)
+      trim(fb);
+    squash_state_.ForgetSquashed();
+  } else {
+    trim(squash_framebuffers_[(squash_framebuffer_index_ + 1) % 2]);
+  }
+
+  for (auto it = framebuffer_pool_.begin(); it != framebuffer_pool_.end();) {
+    if (it->WaitReleased(0)) {
+      ++it;
+      continue;
+    }
+    it = framebuffer_pool_.erase(it);
+    count++;
+  }
+
+  if (count && pre_compositor_)
+    pre_compositor_->QueueReleaseFramebuffers();
+
+  dump_framebuffers_trimmed_ += count;
+  return count;
+}
+
+void DrmDisplayCompositor::ReleaseFramebuffers() {
+  // Nothing is scanned out while the display is off, so drop the active
+  // composition to release everything it holds. The GL compositor may still
+  // be reading its layers.
+  if (pre_compositor_)
+    pre_compositor_->Finish();
+  ClearDisplay();
+
+  AutoLock lock(&framebuffer_lock_, "framebuffer");
+  if (lock.Lock())
+    return;
+
+  size_t count = TrimFramebuffers(true);
+  framebuffers_trimmed_.store(true);
+  if (count)
+    ALOGI("Released %zu framebuffers of display %d", count, display_);
+}
+
+DrmHwcRect<int> DrmDisplayCompositor::GetFramebufferFrame(
+    DrmDisplayComposition *display_comp, DrmCompositionPlane::Type type,
+    uint32_t display_width, uint32_t display_height) {
+  DrmHwcRect<int> frame(0, 0, display_width, display_height);
+
+  // Some hardware can only scan out primary planes covering the whole display
+  DrmPlane *plane = GetFramebufferPlane(display_comp, type);
+  if (plane && plane->type() == DRM_PLANE_TYPE_PRIMARY)
+    return frame;
+
+  const std::vector<DrmCompositionRegion> &regions =
+      GetFramebufferRegions(display_comp, type);
+  DrmHwcRect<int> bounds(display_width, display_height, 0, 0);
+  for (const DrmCompositionRegion &region : regions) {
+    bounds.left = std::min(bounds.left, region.frame.left);
+    bounds.top = std::min(bounds.top, region.frame.top);
+    bounds.right = std::max(bounds.right, region.frame.right);
+    bounds.bottom = std::max(bounds.bottom, region.frame.bottom);
+  }
+
+  bounds.left = std::max(bounds.left, frame.left);
+  bounds.top = std::max(bounds.top, frame.top);
+  bounds.right = std::min(bounds.right, frame.right);
+  bounds.bottom = std::min(bounds.bottom, frame.bottom);
+  if (bounds.left >= bounds.right || bounds.top >= bounds.bottom)
+    return frame;
+
+  return bounds;
+}
+
+PixelFormat DrmDisplayCompositor::GetFramebufferFormat(
+    DrmDisplayComposition *display_comp, DrmCompositionPlane::Type type,
+    const DrmHwcRect<int> &frame) {
+  // Anything left uncovered, or covered only by translucent layers, has to
+  // show the planes below. There's nothing below the primary plane, so it
+  // never needs alpha.
+  DrmPlane *plane = GetFramebufferPlane(display_comp, type);
+  if (!plane)
+    return PIXEL_FORMAT_RGBA_8888;
+
+  if (plane->type() != DRM_PLANE_TYPE_PRIMARY) {
+    int64_t opaque_area = 0;
+    for (const DrmCompositionRegion &region :
+         GetFramebufferRegions(display_comp, type)) {
+      bool opaque = false;
+      for (size_t layer_index : region.source_layers) {
+        if (display_comp->layers()[layer_index].blending ==
+            DrmHwcBlending::kNone)
+          opaque = true;
+      }
+      if (!opaque)
+        return PIXEL_FORMAT_RGBA_8888;
+
+      int left = std::max(region.frame.left, frame.left);
+      int top = std::max(region.frame.top, frame.top);
+      int right = std::min(region.frame.right, frame.right);
+      int bottom = std::min(region.frame.bottom, frame.bottom);
+      if (left < right && top < bottom)
+        opaque_area += (int64_t)(right - left) * (bottom - top);
+    }
+
+    // Regions are disjoint, so they cover frame iff their areas add up to it
+    if (opaque_area < (int64_t)frame.width() * frame.height())
+      return PIXEL_FORMAT_RGBA_8888;
+  }
+
+  char use_16bit_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.precomp_16bit", use_16bit_opt, "0");
+  if (atoi(use_16bit_opt) &&
+      plane->IsSupportedFormat(ConvertHalFormatToDrm(PIXEL_FORMAT_RGB_565)))
+    return PIXEL_FORMAT_RGB_565;
+
+  if (plane->IsSupportedFormat(ConvertHalFormatToDrm(PIXEL_FORMAT_RGBX_8888)))
+    return PIXEL_FORMAT_RGBX_8888;
+
+  return PIXEL_FORMAT_RGBA_8888;
+}
+
+void DrmDisplayCompositor::SwapPooledFramebuffer(DrmFramebuffer &fb,
+                                                 uint32_t width,
+                                                 uint32_t height,
+                                                 PixelFormat format) {
+  auto match = std::find_if(framebuffer_pool_.begin(), framebuffer_pool_.end(),
+                            [&](DrmFramebuffer &pooled) {
+    return pooled.buffer()->getWidth() == width &&
+           pooled.buffer()->getHeight() == height &&
+           pooled.buffer()->getPixelFormat() == format;
+  });
+
+  DrmFramebuffer old_fb(std::move(fb));
+  if (match != framebuffer_pool_.end()) {
+    fb = std::move(*match);
+    framebuffer_pool_.erase(match);
+  }
+
+  // Each format gets its own share of the pool, so a frame flipping between
+  // opaque and translucent content doesn't evict the buffers of the other
+  PixelFormat old_format = old_fb.buffer()->getPixelFormat();
+  framebuffer_pool_.emplace_back(std::move(old_fb));
+
+  auto same_format = [&](DrmFramebuffer &pooled) {
+    return pooled.buffer()->getPixelFormat() == old_format;
+  };
+  if ((size_t)std::count_if(framebuffer_pool_.begin(), framebuffer_pool_.end(),
+                            same_format) > kFramebufferPoolSize) {
+    auto oldest = std::find_if(framebuffer_pool_.begin(),
+                               framebuffer_pool_.end(), same_format);
+    framebuffer_pool_.erase(oldest);
+  }
+}
+
+// Must be called with framebuffer_lock_ held
+void DrmDisplayCompositor::GrowFramebufferRing() {
+  if (framebuffers_[framebuffer_index_].is_released())
+    return;
+
+  // The next framebuffer is still on screen. Rather than having rendering wait
+  // for it, an empty slot is put in front of it.
+  if (framebuffers_.size() >= kMaxFramebufferRingSize) {
+    dump_framebuffer_stalls_++;
+    return;
+  }
+  framebuffers_.emplace(framebuffers_.begin() + framebuffer_index_);
+  dump_framebuffer_ring_grows_++;
+}
+
+int DrmDisplayCompositor::PrepareFramebuffer(
+    DrmFramebuffer &fb, DrmDisplayComposition *display_comp,
+    DrmCompositionPlane::Type type, float scale) {
+  uint32_t display_width, display_height;
+  int ret;
+  std::tie(display_width, display_height, ret) = GetActiveModeResolution();
   if (ret) {
     ALOGE(
         "Failed to allocate framebuffer because the display resolution could "
@@ -261,18 +688,43 @@ int DrmDisplayCompositor::PrepareFramebuffer(
     return ret;
   }
 
-  fb.set_release_fence_fd(-1);
-  if (!fb.Allocate(width, height)) {
+  // The framebuffer only needs to cover the regions it's rendered for. Its
+  // size is rounded up so areas that change slightly between frames keep
+  // reusing the same buffers.
+  DrmHwcRect<int> frame =
+      GetFramebufferFrame(display_comp, type, display_width, display_height);
+  uint32_t scaled_width = lroundf(frame.width() * scale);
+  uint32_t scaled_height = lroundf(frame.height() * scale);
+  uint32_t width = std::min(
+      display_width, (scaled_width + kFramebufferSizeAlignment - 1) /
+                         kFramebufferSizeAlignment * kFramebufferSizeAlignment);
+  uint32_t height = std::min(
+      display_height, (scaled_height + kFramebufferSizeAlignment - 1) /
+                          kFramebufferSizeAlignment * kFramebufferSizeAlignment);
+
+  PixelFormat format = GetFramebufferFormat(display_comp, type, frame);
+
+  if (fb.is_valid() && (fb.buffer()->getWidth() != width ||
+                        fb.buffer()->getHeight() != height ||
+                        fb.buffer()->getPixelFormat() != format))
+    SwapPooledFramebuffer(fb, width, height, format);
+
+  // The framebuffer may still be scanned out. Its release fence stays with it
+  // until rendering is queued, which makes the GPU wait for it.
+  MarkFramebuffersUsed();
+  if (!fb.Allocate(width, height, format)) {
     ALOGE("Failed to allocate framebuffer with size %dx%d", width, height);
     return -ENOMEM;
   }
+  fb.set_display_frame(frame);
 
   display_comp->layers().emplace_back();
   DrmHwcLayer &pre_comp_layer = display_comp->layers().back();
   pre_comp_layer.sf_handle = fb.buffer()->handle;
-  pre_comp_layer.blending = DrmHwcBlending::kPreMult;
-  pre_comp_layer.source_crop = DrmHwcRect<float>(0, 0, width, height);
-  pre_comp_layer.display_frame = DrmHwcRect<int>(0, 0, width, height);
+  pre_comp_layer.blending = GetFramebufferBlending(fb);
+  pre_comp_layer.source_crop =
+      DrmHwcRect<float>(0, 0, scaled_width, scaled_height);
+  pre_comp_layer.display_frame = frame;
   ret = pre_comp_layer.buffer.ImportBuffer(fb.buffer()->handle,
                                            display_comp->importer());
   if (ret) {
@@ -287,65 +739,156 @@ int DrmDisplayCompositor::ApplySquash(DrmDisplayComposition *display_comp) {
   int ret = 0;
 
   DrmFramebuffer &fb = squash_framebuffers_[squash_framebuffer_index_];
-  ret = PrepareFramebuffer(fb, display_comp);
+  if (!fb.is_released())
+    dump_framebuffer_stalls_++;
+  ret = PrepareFramebuffer(fb, display_comp,
+                           DrmCompositionPlane::Type::kSquash, 1.0f);
   if (ret) {
     ALOGE("Failed to prepare framebuffer for squash %d", ret);
     return ret;
   }
 
-  std::vector<DrmCompositionRegion> &regions = display_comp->squash_regions();
-  ret = pre_compositor_->Composite(display_comp->layers().data(),
-                                   regions.data(), regions.size(), fb.buffer(),
-                                   display_comp->importer());
-  pre_compositor_->Finish();
-
+  UniqueFd render_fence;
+  ret = pre_compositor_->Composite(display_comp, true, fb.buffer(),
+                                   fb.TakeReleaseFence(), fb.display_frame(),
+                                   1.0f, &render_fence);
   if (ret) {
     ALOGE("Failed to squash layers");
     return ret;
   }
 
-  ret = display_comp->CreateNextTimelineFence();
+  // The plane waits for the GPU through IN_FENCE_FD
+  display_comp->layers().back().acquire_fence = std::move(render_fence);
+
+  ret = display_comp->CreateCompositionDoneFence();
   if (ret <= 0) {
     ALOGE("Failed to create squash framebuffer release fence %d", ret);
     return ret;
   }
 
   fb.set_release_fence_fd(ret);
-  display_comp->SignalSquashDone();
 
   return 0;
 }
 
+float DrmDisplayCompositor::GetPreCompositeScale() {
+  if (!precomp_downscale_threshold_ns_ || !pre_compositor_)
+    return 1.0f;
+
+  // Rendering at a lower resolution makes composite times drop roughly with
+  // the area, so the full resolution time is estimated from that before
+  // deciding to go back.
+  int64_t composite_time_ns = pre_compositor_->average_composite_time_ns();
+  if (precomp_downscaled_) {
+    float area_scale = precomp_downscale_ * precomp_downscale_;
+    if (composite_time_ns <
+        precomp_downscale_threshold_ns_ * area_scale * kPreCompUpscaleRatio) {
+      precomp_downscaled_ = false;
+      ALOGI("Pre-compositing display %d at full resolution", display_);
+    }
+  } else if (composite_time_ns > precomp_downscale_threshold_ns_) {
+    precomp_downscaled_ = true;
+    ALOGI("Pre-compositing display %d at %.2fx resolution, took %" PRId64 "us",
+          display_, precomp_downscale_, composite_time_ns / 1000);
+  }
+
+  return precomp_downscaled_ ? precomp_downscale_ : 1.0f;
+}
+
+bool DrmDisplayCompositor::TestPreCompositeScaling(
+    DrmDisplayComposition *display_comp) {
+  DrmPlane *plane =
+      GetFramebufferPlane(display_comp, DrmCompositionPlane::Type::kPrecomp);
+  DrmCrtc *crtc = drm_->GetCrtcForDisplay(display_);
+  if (!plane || !crtc)
+    return false;
+
+  // Only the precomp plane is part of the test, everything else keeps its
+  // current state
+  DrmHwcLayer &layer = display_comp->layers().back();
+  int ret = 0;
+  if (!layer.buffer->fb_id)
+    ret = layer.buffer.CreateFrameBuffer(plane->type());
+
+  drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
+  if (!pset) {
+    ALOGE("Failed to allocate property set");
+    return false;
+  }
+  if (!ret)
+    ret = plane->UpdateProperties(pset, crtc->id(), layer);
+  if (!ret)
+    ret = drmModeAtomicCommit(drm_->fd(), pset, DRM_MODE_ATOMIC_TEST_ONLY,
+                              drm_);
+  drmModeAtomicFree(pset);
+
+  ALOGI("Plane %u %s scale pre-composited framebuffers", plane->id(),
+        ret ? "can't" : "can");
+  precomp_scaling_tested_[plane->id()] = !ret;
+  return !ret;
+}
+
 int DrmDisplayCompositor::ApplyPreComposite(
     DrmDisplayComposition *display_comp) {
   int ret = 0;
 
+  // A test commit only tells about the mode it ran in, so each modeset
+  // brings another chance for a plane that failed it
+  uint32_t modesets = modesets_.load();
+  if (modesets != precomp_scaling_modesets_) {
+    precomp_scaling_tested_.clear();
+    precomp_scaling_modesets_ = modesets;
+  }
+
+  // A plane known not to scale goes straight to full resolution, rather than
+  // preparing a downscaled framebuffer only to throw it away
+  DrmPlane *plane =
+      GetFramebufferPlane(display_comp, DrmCompositionPlane::Type::kPrecomp);
+  auto tested = plane ? precomp_scaling_tested_.find(plane->id())
+                      : precomp_scaling_tested_.end();
+  bool known = tested != precomp_scaling_tested_.end();
+  float scale = 1.0f;
+  if (!known || tested->second)
+    scale = GetPreCompositeScale();
+
+  GrowFramebufferRing();
   DrmFramebuffer &fb = framebuffers_[framebuffer_index_];
-  ret = PrepareFramebuffer(fb, display_comp);
+  ret = PrepareFramebuffer(fb, display_comp,
+                           DrmCompositionPlane::Type::kPrecomp, scale);
   if (ret) {
     ALOGE("Failed to prepare framebuffer for pre-composite %d", ret);
     return ret;
   }
 
-  std::vector<DrmCompositionRegion> &regions = display_comp->pre_comp_regions();
-  ret = pre_compositor_->Composite(display_comp->layers().data(),
-                                   regions.data(), regions.size(), fb.buffer(),
-                                   display_comp->importer());
-  pre_compositor_->Finish();
+  if (scale != 1.0f && !known && !TestPreCompositeScaling(display_comp)) {
+    scale = 1.0f;
+    display_comp->layers().pop_back();
+    ret = PrepareFramebuffer(fb, display_comp,
+                             DrmCompositionPlane::Type::kPrecomp, scale);
+    if (ret) {
+      ALOGE("Failed to prepare framebuffer for pre-composite %d", ret);
+      return ret;
+    }
+  }
 
+  UniqueFd render_fence;
+  ret = pre_compositor_->Composite(display_comp, false, fb.buffer(),
+                                   fb.TakeReleaseFence(), fb.display_frame(),
+                                   scale, &render_fence);
   if (ret) {
     ALOGE("Failed to pre-composite layers");
     return ret;
   }
 
-  ret = display_comp->CreateNextTimelineFence();
+  display_comp->layers().back().acquire_fence = std::move(render_fence);
+
+  ret = display_comp->CreateCompositionDoneFence();
   if (ret <= 0) {
     ALOGE("Failed to create pre-composite framebuffer release fence %d", ret);
     return ret;
   }
 
   fb.set_release_fence_fd(ret);
-  display_comp->SignalPreCompDone();
 
   return 0;
 }
@@ -391,13 +934,18 @@ int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp) {
   std::vector<DrmCompositionRegion> &pre_comp_regions =
       display_comp->pre_comp_regions();
 
+  // Usually started by Prewarm, which may still be in progress
   if (!pre_compositor_) {
-    pre_compositor_.reset(new GLWorkerCompositor());
-    int ret = pre_compositor_->Init();
-    if (ret) {
-      ALOGE("Failed to initialize OpenGL compositor %d", ret);
-      return ret;
-    }
+    pre_compositor_.reset(new GLCompositorWorker());
+    pre_compositor_->SetSchedPeriod(refresh_period_ns_.load());
+    ret = pre_compositor_->Init();
+  } else {
+    ret = pre_compositor_->WaitForInit();
+  }
+  if (ret) {
+    ALOGE("Failed to initialize OpenGL compositor %d", ret);
+    pre_compositor_.reset();
+    return ret;
   }
 
   int squash_layer_index = -1;
@@ -411,6 +959,11 @@ int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp) {
   } else {
     if (UsesSquash(comp_planes)) {
       DrmFramebuffer &fb = squash_framebuffers_[squash_framebuffer_index_];
+      if (!fb.is_valid()) {
+        ALOGE("Failed to reuse squashed framebuffer, it was released");
+        return -EINVAL;
+      }
+      MarkFramebuffersUsed();
       layers.emplace_back();
       squash_layer_index = layers.size() - 1;
       DrmHwcLayer &squash_layer = layers.back();
@@ -421,12 +974,11 @@ int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp) {
         return ret;
       }
       squash_layer.sf_handle = fb.buffer()->handle;
-      squash_layer.blending = DrmHwcBlending::kPreMult;
+      squash_layer.blending = GetFramebufferBlending(fb);
       squash_layer.source_crop = DrmHwcRect<float>(
-          0, 0, squash_layer.buffer->width, squash_layer.buffer->height);
-      squash_layer.display_frame = DrmHwcRect<int>(
-          0, 0, squash_layer.buffer->width, squash_layer.buffer->height);
-      ret = display_comp->CreateNextTimelineFence();
+          0, 0, fb.display_frame().width(), fb.display_frame().height());
+      squash_layer.display_frame = fb.display_frame();
+      ret = display_comp->CreateCompositionDoneFence();
 
       if (ret <= 0) {
         ALOGE("Failed to create squash framebuffer release fence %d", ret);
@@ -446,7 +998,7 @@ int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp) {
       return ret;
 
     pre_comp_layer_index = layers.size() - 1;
-    framebuffer_index_ = (framebuffer_index_ + 1) % DRM_DISPLAY_BUFFERS;
+    framebuffer_index_ = (framebuffer_index_ + 1) % framebuffers_.size();
   }
 
   for (DrmCompositionPlane &comp_plane : comp_planes) {
@@ -477,8 +1029,9 @@ int DrmDisplayCompositor::PrepareFrame(DrmDisplayComposition *display_comp) {
   return ret;
 }
 
-int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
-                                      bool test_only) {
+int DrmDisplayCompositor::CommitFrame(
+    DrmDisplayComposition *display_comp, bool test_only,
+    std::unique_ptr<DrmEventHandler> flip_handler) {
   ATRACE_CALL();
 
   int ret = 0;
@@ -586,19 +1139,39 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
   }
 
 out:
+  // Drivers that can switch the refresh rate without blanking accept the new
+  // mode without ALLOW_MODESET
+  bool allow_modeset = mode_.needs_modeset;
+  if (!ret && !test_only && mode_.needs_modeset && mode_.try_seamless) {
+    if (!drmModeAtomicCommit(drm_->fd(), pset, DRM_MODE_ATOMIC_TEST_ONLY,
+                             drm_)) {
+      allow_modeset = false;
+    } else {
+      ALOGI("Refresh rate switch on display %d needs a modeset", display_);
+      mode_.try_seamless = false;
+    }
+  }
+
   if (!ret) {
     uint32_t flags = 0;
     if (test_only) {
       flags |= DRM_MODE_ATOMIC_TEST_ONLY;
-    } else if (mode_.needs_modeset) {
+    } else if (allow_modeset) {
       flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
 #ifndef USE_DISABLE_OVERLAY_USAGE
     } else {
       flags |= DRM_MODE_ATOMIC_NONBLOCK;
 #endif
     }
+    // The flip event tells when the frame was latched. The handler belongs to
+    // the event listener once a commit asking for it succeeds.
+    void *user_data = drm_;
+    if (flip_handler && !test_only && !allow_modeset) {
+      flags |= DRM_MODE_PAGE_FLIP_EVENT;
+      user_data = flip_handler.get();
+    }
 
-    ret = drmModeAtomicCommit(drm_->fd(), pset, flags, drm_);
+    ret = drmModeAtomicCommit(drm_->fd(), pset, flags, user_data);
     if (ret) {
       if (test_only)
         ALOGI("Commit test pset failed ret=%d\n", ret);
@@ -609,8 +1182,12 @@ out:
 	// the commits Asynchronously. For now do a
 	// blocking commit in case the non-blocking commit
 	// failed.
-	if (!mode_.needs_modeset)
-	  ret = drmModeAtomicCommit(drm_->fd(), pset, 0, drm_);
+	if (!allow_modeset)
+	  ret = drmModeAtomicCommit(drm_->fd(), pset,
+	                            flags & DRM_MODE_PAGE_FLIP_EVENT,
+	                            user_data);
+	if (!ret && (flags & DRM_MODE_PAGE_FLIP_EVENT))
+	  flip_handler.release();
 
 	if (ret) {
 	  ALOGE("Failed to commit pset ret=%d\n", ret);
@@ -619,29 +1196,26 @@ out:
       drmModeAtomicFree(pset);
       return ret;
     }
+    if (flags & DRM_MODE_PAGE_FLIP_EVENT)
+      flip_handler.release();
   }
   if (pset)
     drmModeAtomicFree(pset);
 
   if (!test_only && mode_.needs_modeset) {
-    ret = drm_->DestroyPropertyBlob(mode_.old_blob_id);
-    if (ret) {
-      ALOGE("Failed to destroy old mode property blob %" PRIu32 "/%d",
-            mode_.old_blob_id, ret);
-      return ret;
-    }
-
     /* TODO: Add dpms to the pset when the kernel supports it */
-    ret = ApplyDpms(display_comp);
+    if (allow_modeset)
+      ret = ApplyDpms(display_comp);
     if (ret) {
       ALOGE("Failed to apply DPMS after modeset %d\n", ret);
       return ret;
     }
 
     connector->set_active_mode(mode_.mode);
-    mode_.old_blob_id = mode_.blob_id;
+    modesets_++;
     mode_.blob_id = 0;
     mode_.needs_modeset = false;
+    mode_.try_seamless = false;
   }
 
   if (crtc->out_fence_ptr_property().id()) {
@@ -669,6 +1243,45 @@ int DrmDisplayCompositor::ApplyDpms(DrmDisplayComposition *display_comp) {
   return 0;
 }
 
+bool DrmDisplayCompositor::AdoptBootMode(const DrmMode &mode) {
+  DrmCrtc *crtc = drm_->GetCrtcForDisplay(display_);
+  DrmConnector *connector = drm_->GetConnectorForDisplay(display_);
+  if (!crtc || !connector || !crtc->mode_valid() || !(crtc->mode() == mode))
+    return false;
+
+  // The crtc has to be driving this connector already, otherwise routing the
+  // connector to it takes a modeset anyway. Picking the display pipe has
+  // pointed the connector at crtc already, so only the routing the kernel
+  // reported at probe time tells.
+  DrmEncoder *encoder = connector->encoder();
+  if (!encoder || connector->probed_encoder_id() != encoder->id() ||
+      encoder->probed_crtc_id() != crtc->id())
+    return false;
+
+  ALOGI("Display %d keeps the %s mode it booted with", display_,
+        mode.name().c_str());
+  connector->set_active_mode(mode);
+  mode_.needs_modeset = false;
+  SetSchedPeriod(mode);
+  return true;
+}
+
+void DrmDisplayCompositor::SetSchedPeriod(const DrmMode &mode) {
+  if (mode.v_refresh() <= 0.0f)
+    return;
+
+  int64_t period_ns = (int64_t)(1000 * 1000 * 1000 / mode.v_refresh());
+  refresh_period_ns_.store(period_ns);
+  if (commit_worker_)
+    commit_worker_->SetSchedPeriod(period_ns);
+
+  AutoLock lock(&framebuffer_lock_, "framebuffer");
+  if (lock.Lock())
+    return;
+  if (pre_compositor_)
+    pre_compositor_->SetSchedPeriod(period_ns);
+}
+
 std::tuple<int, uint32_t> DrmDisplayCompositor::CreateModeBlob(
     const DrmMode &mode) {
   struct drm_mode_modeinfo drm_mode;
@@ -686,6 +1299,36 @@ std::tuple<int, uint32_t> DrmDisplayCompositor::CreateModeBlob(
   return std::make_tuple(ret, id);
 }
 
+std::tuple<int, uint32_t> DrmDisplayCompositor::GetModeBlob(
+    const DrmMode &mode) {
+  auto blob = mode_blobs_.find(mode.id());
+  if (blob != mode_blobs_.end())
+    return std::make_tuple(0, blob->second);
+
+  int ret;
+  uint32_t id;
+  std::tie(ret, id) = CreateModeBlob(mode);
+  if (ret)
+    return std::make_tuple(ret, 0);
+
+  // Modes the connector dropped since, after a hotplug, won't come back with
+  // the same id
+  DrmConnector *connector = drm_->GetConnectorForDisplay(display_);
+  for (auto it = mode_blobs_.begin(); connector && it != mode_blobs_.end();) {
+    bool offered = std::any_of(
+        connector->modes().begin(), connector->modes().end(),
+        [&it](const DrmMode &m) { return m.id() == it->first; });
+    if (offered) {
+      ++it;
+      continue;
+    }
+    drm_->DestroyPropertyBlob(it->second);
+    it = mode_blobs_.erase(it);
+  }
+  mode_blobs_[mode.id()] = id;
+  return std::make_tuple(0, id);
+}
+
 void DrmDisplayCompositor::ClearDisplay() {
   AutoLock lock(&lock_, "compositor");
   int ret = lock.Lock();
@@ -703,15 +1346,135 @@ void DrmDisplayCompositor::ClearDisplay() {
   active_composition_.reset(NULL);
 }
 
+int DrmDisplayCompositor::PrepareComposition(
+    DrmDisplayComposition *composition) {
+  int ret = pthread_mutex_lock(&framebuffer_lock_);
+  if (ret) {
+    ALOGE("Failed to acquire framebuffer lock %d", ret);
+    return ret;
+  }
+  ret = PrepareFrame(composition);
+  pthread_mutex_unlock(&framebuffer_lock_);
+  if (ret) {
+    ALOGE("Failed to prepare frame for display %d", display_);
+    // The GL compositor may still be reading the layers of the composition
+    if (pre_compositor_)
+      pre_compositor_->Finish();
+  }
+  return ret;
+}
+
+size_t DrmDisplayCompositor::SubstituteLateLayers(
+    DrmDisplayComposition *composition) {
+  AutoLock lock(&lock_, "compositor");
+  if (lock.Lock())
+    return 0;
+
+  // Substituting for a frame that substituted itself would keep a chain of
+  // compositions, and their release fences, around
+  if (!active_composition_ || active_composition_->holds_previous())
+    return 0;
+
+  std::vector<DrmHwcLayer> &layers = composition->layers();
+  std::vector<DrmHwcLayer> &active_layers = active_composition_->layers();
+  size_t substituted = 0;
+  for (DrmCompositionPlane &comp_plane : composition->composition_planes()) {
+    if (comp_plane.type() != DrmCompositionPlane::Type::kLayer ||
+        comp_plane.source_layers().size() != 1)
+      continue;
+    DrmHwcLayer &layer = layers[comp_plane.source_layers().front()];
+    if (layer.acquire_fence.get() < 0 ||
+        sync_wait(layer.acquire_fence.get(), 0) == 0)
+      continue;
+
+    // Only the same layer in the same place is worth showing instead, as far
+    // as can be told without knowing which layer it was
+    auto active_plane = std::find_if(
+        active_composition_->composition_planes().begin(),
+        active_composition_->composition_planes().end(),
+        [&](DrmCompositionPlane &plane) {
+          return plane.plane() == comp_plane.plane() &&
+                 plane.type() == DrmCompositionPlane::Type::kLayer &&
+                 plane.source_layers().size() == 1;
+        });
+    if (active_plane == active_composition_->composition_planes().end())
+      continue;
+    DrmHwcLayer &active_layer =
+        active_layers[active_plane->source_layers().front()];
+    if (!active_layer.buffer ||
+        !(active_layer.display_frame == layer.display_frame) ||
+        active_layer.blending != layer.blending)
+      continue;
+
+    // The buffers go with the new composition, which keeps the active one,
+    // and so its release fences, until it's replaced itself. The late layer
+    // stays with it until its buffer is ready.
+    DrmHwcLayer stand_in;
+    stand_in.sf_handle = active_layer.sf_handle;
+    stand_in.gralloc_buffer_usage = active_layer.gralloc_buffer_usage;
+    stand_in.buffer = std::move(active_layer.buffer);
+    stand_in.handle = std::move(active_layer.handle);
+    stand_in.transform = active_layer.transform;
+    stand_in.blending = layer.blending;
+    stand_in.alpha = active_layer.alpha;
+    stand_in.source_crop = active_layer.source_crop;
+    stand_in.display_frame = layer.display_frame;
+    composition->SubstituteLayer(comp_plane.source_layers().front(),
+                                 std::move(stand_in));
+    dump_substitutions_[comp_plane.plane()->id()]++;
+    substituted++;
+  }
+
+  return substituted;
+}
+
+bool DrmDisplayCompositor::GetLateFences(std::vector<UniqueFd> *fences) {
+  AutoLock lock(&lock_, "compositor");
+  if (lock.Lock())
+    return false;
+
+  if (!active_composition_ || !active_composition_->has_late_layers())
+    return false;
+  active_composition_->GetLateFences(fences);
+  return true;
+}
+
+int DrmDisplayCompositor::CommitLateLayers(
+    std::unique_ptr<DrmEventHandler> latch_handler) {
+  AutoLock lock(&lock_, "compositor");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  // A frame committed meanwhile took the late layers' place already
+  if (!active_composition_ || !active_composition_->has_late_layers())
+    return 0;
+
+  active_composition_->RestoreLateLayers();
+  ret = CommitFrame(active_composition_.get(), false, std::move(latch_handler));
+  lock.Unlock();
+  if (ret) {
+    ALOGE("Failed to commit late layers for display %d", display_);
+    ClearDisplay();
+    return ret;
+  }
+  ++dump_late_layer_commits_;
+  return 0;
+}
+
 void DrmDisplayCompositor::ApplyFrame(
-    std::unique_ptr<DrmDisplayComposition> composition, int status) {
+    std::unique_ptr<DrmDisplayComposition> composition, int status,
+    std::unique_ptr<DrmEventHandler> latch_handler) {
   int ret = status;
 
   if (!ret)
-    ret = CommitFrame(composition.get(), false);
+    ret = CommitFrame(composition.get(), false, std::move(latch_handler));
 
   if (ret) {
     ALOGE("Composite failed for display %d", display_);
+    // The GL compositor may still be reading the layers of the compositions
+    if (pre_compositor_)
+      pre_compositor_->Finish();
     // Disable the hw used by the last active composition. This allows us to
     // signal the release fences from that composition to avoid hanging.
     ClearDisplay();
@@ -719,13 +1482,14 @@ void DrmDisplayCompositor::ApplyFrame(
   }
   ++dump_frames_composited_;
 
-  if (active_composition_)
-    active_composition_->SignalCompositionDone();
-
   ret = pthread_mutex_lock(&lock_);
   if (ret)
     ALOGE("Failed to acquire lock for active_composition swap");
 
+  if (composition->substituted_layers())
+    composition->HoldPrevious(std::move(active_composition_));
+  else if (active_composition_)
+    active_composition_->SignalCompositionDone();
   active_composition_.swap(composition);
 
   if (!ret)
@@ -737,33 +1501,63 @@ void DrmDisplayCompositor::ApplyFrame(
 int DrmDisplayCompositor::ApplyComposition(
     std::unique_ptr<DrmDisplayComposition> composition) {
   int ret = 0;
+  // Only the state the display booted with can be taken over
+  bool adopt_boot_mode = adopt_boot_mode_;
+  adopt_boot_mode_ = false;
   switch (composition->type()) {
     case DRM_COMPOSITION_TYPE_FRAME:
-      ret = PrepareFrame(composition.get());
-      if (ret) {
-        ALOGE("Failed to prepare frame for display %d", display_);
+      // In mailbox mode frames are only prepared once they're about to be
+      // committed, so frames replaced before then cost no GL work
+      if (commit_worker_ && commit_worker_->UpdateMailbox())
+        return commit_worker_->QueueFrame(std::move(composition), false);
+
+      ret = PrepareComposition(composition.get());
+      if (ret)
         return ret;
-      }
 
-      ApplyFrame(std::move(composition), false);
+      if (commit_worker_)
+        return commit_worker_->QueueFrame(std::move(composition), true);
+      ApplyFrame(std::move(composition), 0);
       break;
     case DRM_COMPOSITION_TYPE_DPMS:
+      // Frames queued before the display changes have to reach it first
+      if (commit_worker_)
+        commit_worker_->Flush();
       active_ = (composition->dpms_mode() == DRM_MODE_DPMS_ON);
       ret = ApplyDpms(composition.get());
       if (ret)
         ALOGE("Failed to apply dpms for display %d", display_);
+      else if (!active_)
+        ReleaseFramebuffers();
       return ret;
     case DRM_COMPOSITION_TYPE_MODESET:
-      mode_.mode = composition->display_mode();
-      if (mode_.blob_id)
-        drm_->DestroyPropertyBlob(mode_.blob_id);
-      std::tie(ret, mode_.blob_id) = CreateModeBlob(mode_.mode);
+      if (commit_worker_)
+        commit_worker_->Flush();
+    {
+      const DrmMode &mode = composition->display_mode();
+      // Whether the crtc is already scanning out a mode of the same size
+      bool committed = !mode_.needs_modeset && mode_.mode.id();
+      bool same_size = committed &&
+                       mode_.mode.h_display() == mode.h_display() &&
+                       mode_.mode.v_display() == mode.v_display();
+      if (committed && mode_.mode == mode)
+        return 0;
+
+      mode_.mode = mode;
+      if (adopt_boot_mode && AdoptBootMode(mode_.mode))
+        return 0;
+      std::tie(ret, mode_.blob_id) = GetModeBlob(mode_.mode);
       if (ret) {
         ALOGE("Failed to create mode blob for display %d", display_);
         return ret;
       }
+      // A pending switch that never made it to the screen may have had a
+      // different size, in which case a modeset is the safe bet
+      mode_.try_seamless = same_size;
       mode_.needs_modeset = true;
+      SetSchedPeriod(mode_.mode);
       return 0;
+    }
     default:
       ALOGE("Unknown composition type %d", composition->type());
       return -EINVAL;
@@ -773,6 +1567,9 @@ int DrmDisplayCompositor::ApplyComposition(
 }
 
 int DrmDisplayCompositor::SquashAll() {
+  if (commit_worker_)
+    commit_worker_->Flush();
+
   AutoLock lock(&lock_, "compositor");
   int ret = lock.Lock();
   if (ret)
@@ -782,7 +1579,11 @@ int DrmDisplayCompositor::SquashAll() {
     return 0;
 
   std::unique_ptr<DrmDisplayComposition> comp = CreateComposition();
+  ret = pthread_mutex_lock(&framebuffer_lock_);
+  if (ret)
+    return ret;
   ret = SquashFrame(active_composition_.get(), comp.get());
+  pthread_mutex_unlock(&framebuffer_lock_);
 
   // ApplyFrame needs the lock
   lock.Unlock();
@@ -887,7 +1688,7 @@ int DrmDisplayCompositor::SquashFrame(DrmDisplayComposition *src,
   }
 
   pre_comp_layer_index = dst->layers().size() - 1;
-  framebuffer_index_ = (framebuffer_index_ + 1) % DRM_DISPLAY_BUFFERS;
+  framebuffer_index_ = (framebuffer_index_ + 1) % framebuffers_.size();
 
   for (DrmCompositionPlane &plane : dst->composition_planes()) {
     if (plane.type() == DrmCompositionPlane::Type::kPrecomp) {
@@ -946,6 +1747,54 @@ void DrmDisplayCompositor::Dump(std::ostringstream *out) const {
 
   squash_state_.Dump(out);
 
+  if (!pthread_mutex_lock(&framebuffer_lock_)) {
+    size_t count = 0;
+    size_t bytes = 0;
+    auto account = [&](const DrmFramebuffer &fb) {
+      sp<GraphicBuffer> buffer = fb.buffer();
+      if (buffer == NULL)
+        return;
+      count++;
+      bytes += (size_t)buffer->getStride() * buffer->getHeight() *
+               bytesPerPixel(buffer->getPixelFormat());
+    };
+    for (const DrmFramebuffer &fb : framebuffers_)
+      account(fb);
+    for (const DrmFramebuffer &fb : squash_framebuffers_)
+      account(fb);
+    for (const DrmFramebuffer &fb : framebuffer_pool_)
+      account(fb);
+    uint64_t trimmed = dump_framebuffers_trimmed_;
+    size_t ring = framebuffers_.size();
+    uint64_t grows = dump_framebuffer_ring_grows_;
+    uint64_t stalls = dump_framebuffer_stalls_;
+    if (pre_compositor_)
+      pre_compositor_->DumpScheduling(out);
+    pthread_mutex_unlock(&framebuffer_lock_);
+
+    *out << "----Framebuffers count=" << count << " kb=" << bytes / 1024
+         << " trimmed=" << trimmed << " ring=" << ring << " grows=" << grows
+         << " stalls=" << stalls
+         << " idle_timeout_ms=" << framebuffer_idle_timeout_ns_ / (1000 * 1000)
+         << "\n";
+  }
+
+  if (!dump_substitutions_.empty()) {
+    *out << "----Late layer substitutions";
+    for (auto &substitutions : dump_substitutions_)
+      *out << " plane[" << substitutions.first
+           << "]=" << substitutions.second;
+    *out << " late_layer_commits=" << dump_late_layer_commits_ << "\n";
+  }
+
+  if (commit_worker_)
+    commit_worker_->Dump(out);
+
+  if (render_timeline_)
+    render_timeline_->Dump(out);
+  if (display_timeline_)
+    display_timeline_->Dump(out);
+
   pthread_mutex_unlock(&lock_);
 }
 }
@@ -19,13 +19,19 @@
 
 #include "drmhwcomposer.h"
 #include "drmdisplaycomposition.h"
+#include "drmeventlistener.h"
 #include "drmframebuffer.h"
 #include "separate_rects.h"
+#include "synctimeline.h"
+#include "vsyncmodel.h"
 
 #include <pthread.h>
+#include <atomic>
+#include <map>
 #include <memory>
 #include <sstream>
 #include <tuple>
+#include <vector>
 
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
@@ -36,7 +42,9 @@
 
 namespace android {
 
-class GLWorkerCompositor;
+class DrmCommitWorker;
+class DrmCompositorWorker;
+class GLCompositorWorker;
 
 class SquashState {
  public:
@@ -68,6 +76,9 @@ class SquashState {
   void RecordHistory(DrmHwcLayer *layers, size_t num_layers,
                      const std::vector<bool> &changed_regions);
   bool RecordAndCompareSquashed(const std::vector<bool> &squashed_regions);
+  // Marks every region as not squashed, so the next frame squashing any of
+  // them renders the squash framebuffer again
+  void ForgetSquashed();
 
   void Dump(std::ostringstream *out) const;
 
@@ -92,6 +103,40 @@ class DrmDisplayCompositor {
   int SquashAll();
   void Dump(std::ostringstream *out) const;
 
+  // Frames are committed for the vblanks this predicts
+  void SetVSyncModel(std::shared_ptr<const VSyncModel> model);
+
+  // Prepares a frame queued unprepared, called on the commit worker
+  int PrepareComposition(DrmDisplayComposition *composition);
+  // Layers on planes of their own whose acquire fence hasn't signaled take
+  // the buffer the active composition shows on the same plane, so the rest of
+  // the frame doesn't have to wait for them. Returns how many did.
+  size_t SubstituteLateLayers(DrmDisplayComposition *composition);
+  // Duplicates the acquire fences of late layers the active composition set
+  // aside which haven't signaled yet. Returns false if it has none left to
+  // put back.
+  bool GetLateFences(std::vector<UniqueFd> *fences);
+  // Commits the active composition again with its late layers back in place
+  // of their stand-ins, called on the commit worker once their buffers are
+  // ready. latch_handler receives the page flip event.
+  int CommitLateLayers(std::unique_ptr<DrmEventHandler> latch_handler);
+  // Commits a prepared frame and makes it the active composition, called on
+  // the commit worker. latch_handler receives the page flip event.
+  void ApplyFrame(std::unique_ptr<DrmDisplayComposition> composition,
+                  int status,
+                  std::unique_ptr<DrmEventHandler> latch_handler =
+                      std::unique_ptr<DrmEventHandler>());
+
+  // Gets the GL compositor and a framebuffer ready on a background thread, so
+  // the first frame that needs them doesn't have to
+  void StartPrewarm();
+  void Prewarm();
+
+  // How long until unused framebuffers should be trimmed, or -1 if there is
+  // nothing to trim until they're used again
+  int64_t GetFramebufferTrimDelayNs() const;
+  void TrimIdleFramebuffers();
+
   std::tuple<uint32_t, uint32_t, int> GetActiveModeResolution();
 
   SquashState *squash_state() {
@@ -101,52 +146,125 @@ class DrmDisplayCompositor {
  private:
   struct ModeState {
     bool needs_modeset = false;
+    // The pending mode only changes the refresh rate, so the switch is tried
+    // without a modeset first
+    bool try_seamless = false;
     DrmMode mode;
     uint32_t blob_id = 0;
-    uint32_t old_blob_id = 0;
   };
 
   DrmDisplayCompositor(const DrmDisplayCompositor &) = delete;
 
-  // We'll wait for acquire fences to fire for kAcquireWaitTimeoutMs,
-  // kAcquireWaitTries times, logging a warning in between.
-  static const int kAcquireWaitTries = 5;
-  static const int kAcquireWaitTimeoutMs = 100;
-
-  int PrepareFramebuffer(DrmFramebuffer &fb,
-                         DrmDisplayComposition *display_comp);
+  // Precomposition framebuffers are allocated in multiples of this size, and
+  // up to kFramebufferPoolSize buffers per format of sizes not currently in use
+  // are kept around for reuse.
+  static const uint32_t kFramebufferSizeAlignment = 64;
+  static const size_t kFramebufferPoolSize = 3;
+
+  // The display may release precomposition framebuffers late, in which case
+  // the ring grows rather than making the GPU wait, up to this many buffers.
+  static const size_t kMaxFramebufferRingSize = 6;
+
+  // Reduced resolution pre-composition stops once the estimated full
+  // resolution composite time drops below this fraction of the threshold
+  static constexpr float kPreCompUpscaleRatio = 0.8f;
+  static constexpr float kMinPreCompScale = 0.25f;
+
+  DrmHwcRect<int> GetFramebufferFrame(DrmDisplayComposition *display_comp,
+                                      DrmCompositionPlane::Type type,
+                                      uint32_t display_width,
+                                      uint32_t display_height);
+  PixelFormat GetFramebufferFormat(DrmDisplayComposition *display_comp,
+                                   DrmCompositionPlane::Type type,
+                                   const DrmHwcRect<int> &frame);
+  void GrowFramebufferRing();
+  void SwapPooledFramebuffer(DrmFramebuffer &fb, uint32_t width,
+                             uint32_t height, PixelFormat format);
+  int PrepareFramebuffer(DrmFramebuffer &fb, DrmDisplayComposition *display_comp,
+                         DrmCompositionPlane::Type type, float scale);
+  void MarkFramebuffersUsed();
+  size_t TrimFramebuffers(bool all);
+  void ReleaseFramebuffers();
+  float GetPreCompositeScale();
+  bool TestPreCompositeScaling(DrmDisplayComposition *display_comp);
   int ApplySquash(DrmDisplayComposition *display_comp);
   int ApplyPreComposite(DrmDisplayComposition *display_comp);
   int PrepareFrame(DrmDisplayComposition *display_comp);
-  int CommitFrame(DrmDisplayComposition *display_comp, bool test_only);
+  int CommitFrame(DrmDisplayComposition *display_comp, bool test_only,
+                  std::unique_ptr<DrmEventHandler> flip_handler =
+                      std::unique_ptr<DrmEventHandler>());
   int SquashFrame(DrmDisplayComposition *src, DrmDisplayComposition *dst);
   int ApplyDpms(DrmDisplayComposition *display_comp);
   int DisablePlanes(DrmDisplayComposition *display_comp);
 
   void ClearDisplay();
-  void ApplyFrame(std::unique_ptr<DrmDisplayComposition> composition,
-                  int status);
 
   std::tuple<int, uint32_t> CreateModeBlob(const DrmMode &mode);
+  // Blobs are kept for as long as the connector offers their mode
+  std::tuple<int, uint32_t> GetModeBlob(const DrmMode &mode);
+  // Display threads scheduled by deadline get their runtime per refresh
+  void SetSchedPeriod(const DrmMode &mode);
+  // Takes over mode if the crtc is already scanning it out to the connector,
+  // so the first frame is committed as a plain page flip without a mode blob
+  bool AdoptBootMode(const DrmMode &mode);
 
   DrmResources *drm_;
   int display_;
 
   std::unique_ptr<DrmDisplayComposition> active_composition_;
 
+  // Release fences of every composition come from these, rather than a
+  // timeline per frame
+  std::shared_ptr<SyncTimeline> render_timeline_;
+  std::shared_ptr<SyncTimeline> display_timeline_;
+
   bool initialized_;
   bool active_;
   bool use_hw_overlays_;
 
   ModeState mode_;
+  // Mode property blobs by mode id
+  std::map<uint32_t, uint32_t> mode_blobs_;
 
   int framebuffer_index_;
-  DrmFramebuffer framebuffers_[DRM_DISPLAY_BUFFERS];
-  std::unique_ptr<GLWorkerCompositor> pre_compositor_;
+  std::vector<DrmFramebuffer> framebuffers_;
+  std::unique_ptr<GLCompositorWorker> pre_compositor_;
 
   SquashState squash_state_;
   int squash_framebuffer_index_;
   DrmFramebuffer squash_framebuffers_[2];
+  std::vector<DrmFramebuffer> framebuffer_pool_;
+
+  // The framebuffers above and pre_compositor_ are also used by
+  // background_worker_, so the frame path holds framebuffer_lock_ while
+  // preparing frames. Framebuffers are released once they have gone unused
+  // for framebuffer_idle_timeout_ns_, and whenever the display is turned off.
+  mutable pthread_mutex_t framebuffer_lock_;
+  int64_t framebuffer_idle_timeout_ns_;
+  std::atomic<int64_t> last_framebuffer_use_ns_;
+  std::atomic<bool> framebuffers_trimmed_;
+  uint32_t prewarm_width_;
+  uint32_t prewarm_height_;
+  int64_t prewarm_start_ns_;
+  std::unique_ptr<DrmCompositorWorker> background_worker_;
+
+  // Frames are prepared on the caller's thread and committed on this one
+  std::unique_ptr<DrmCommitWorker> commit_worker_;
+  // Refresh period of the current mode, 0 until one is set
+  std::atomic<int64_t> refresh_period_ns_;
+  // Whether the next composition may take over the boot mode
+  bool adopt_boot_mode_;
+
+  int64_t precomp_downscale_threshold_ns_;
+  float precomp_downscale_;
+  bool precomp_downscaled_;
+  // Whether a plane passed a test commit scanning out a downscaled
+  // framebuffer, by plane id, since the modeset precomp_scaling_modesets_
+  // counted up to
+  std::map<uint32_t, bool> precomp_scaling_tested_;
+  // Modesets committed, counted on the thread committing frames
+  std::atomic<uint32_t> modesets_;
+  uint32_t precomp_scaling_modesets_;
 
   // mutable since we need to acquire in Dump()
   mutable pthread_mutex_t lock_;
@@ -155,6 +273,14 @@ class DrmDisplayCompositor {
   // we need to reset them on every Dump() call.
   mutable uint64_t dump_frames_composited_;
   mutable uint64_t dump_last_timestamp_ns_;
+  // Not reset by Dump(), protected by framebuffer_lock_
+  uint64_t dump_framebuffers_trimmed_;
+  uint64_t dump_framebuffer_ring_grows_;
+  uint64_t dump_framebuffer_stalls_;
+  // Late layer substitutions by plane id and the commits that put the late
+  // layers back, protected by lock_
+  std::map<uint32_t, uint64_t> dump_substitutions_;
+  uint64_t dump_late_layer_commits_;
 };
 }
 
@@ -27,6 +27,7 @@ DrmEncoder::DrmEncoder(drmModeEncoderPtr e, DrmCrtc *current_crtc,
                        const std::vector<DrmCrtc *> &possible_crtcs)
     : id_(e->encoder_id),
       crtc_(current_crtc),
+      probed_crtc_id_(e->crtc_id),
       type_(e->encoder_type),
       possible_crtcs_(possible_crtcs) {
 }
@@ -42,4 +43,8 @@ DrmCrtc *DrmEncoder::crtc() const {
 void DrmEncoder::set_crtc(DrmCrtc *crtc) {
   crtc_ = crtc;
 }
+
+uint32_t DrmEncoder::probed_crtc_id() const {
+  return probed_crtc_id_;
+}
 }
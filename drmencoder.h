@@ -36,6 +36,9 @@ class DrmEncoder {
 
   DrmCrtc *crtc() const;
   void set_crtc(DrmCrtc *crtc);
+  // The crtc the kernel had the encoder driving when it was probed, 0 if none.
+  // Unlike crtc(), it stays put when a display pipe is picked.
+  uint32_t probed_crtc_id() const;
 
   const std::vector<DrmCrtc *> &possible_crtcs() const {
     return possible_crtcs_;
@@ -44,6 +47,7 @@ class DrmEncoder {
  private:
   uint32_t id_;
   DrmCrtc *crtc_;
+  uint32_t probed_crtc_id_;
 
   uint32_t type_;
 
@@ -17,11 +17,19 @@
 #define LOG_TAG "hwc-drm-event-listener"
 
 #include "drmeventlistener.h"
+#include "autolock.h"
 #include "drmresources.h"
 
+#include <algorithm>
+
 #include <errno.h>
+#include <inttypes.h>
 #include <linux/netlink.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <time.h>
 
 #include <cutils/log.h>
 #include <hardware/hardware.h>
@@ -30,13 +38,34 @@
 
 namespace android {
 
+static int64_t GetTimeNs() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+  return ts.tv_sec * 1000LL * 1000 * 1000 + ts.tv_nsec;
+}
+
 DrmEventListener::DrmEventListener(DrmResources *drm)
     : Worker("drm-event-listener", HAL_PRIORITY_URGENT_DISPLAY),
       drm_(drm) {
+  pthread_mutex_init(&handlers_lock_, NULL);
+}
+
+static int AddToEpoll(int epoll_fd, int fd) {
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+    ALOGE("Failed to add fd %d to epoll %d", fd, -errno);
+    return -errno;
+  }
+  return 0;
 }
 
 int DrmEventListener::Init() {
-  uevent_fd_.Set(socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT));
+  uevent_fd_.Set(socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        NETLINK_KOBJECT_UEVENT));
   if (uevent_fd_.get() < 0) {
     ALOGE("Failed to open uevent socket %d", uevent_fd_.get());
     return uevent_fd_.get();
@@ -54,19 +83,104 @@ int DrmEventListener::Init() {
     return -errno;
   }
 
-  FD_ZERO(&fds_);
-  FD_SET(drm_->fd(), &fds_);
-  FD_SET(uevent_fd_.get(), &fds_);
-  max_fd_ = std::max(drm_->fd(), uevent_fd_.get());
+  wake_fd_.Set(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+  if (wake_fd_.get() < 0) {
+    ALOGE("Failed to create wake eventfd %d", -errno);
+    return -errno;
+  }
+
+  epoll_fd_.Set(epoll_create1(EPOLL_CLOEXEC));
+  if (epoll_fd_.get() < 0) {
+    ALOGE("Failed to create epoll %d", -errno);
+    return -errno;
+  }
+
+  ret = AddToEpoll(epoll_fd_.get(), drm_->fd());
+  if (!ret)
+    ret = AddToEpoll(epoll_fd_.get(), uevent_fd_.get());
+  if (!ret)
+    ret = AddToEpoll(epoll_fd_.get(), wake_fd_.get());
+  if (ret)
+    return ret;
 
   return InitWorker();
 }
 
+int DrmEventListener::Exit() {
+  if (!initialized())
+    return 0;
+
+  uint64_t value = 1;
+  if (write(wake_fd_.get(), &value, sizeof(value)) < 0)
+    ALOGE("Failed to wake drm event listener %d", -errno);
+  return Worker::Exit();
+}
+
 void DrmEventListener::RegisterHotplugHandler(DrmEventHandler *handler) {
   assert(!hotplug_handler_);
   hotplug_handler_ = handler;
 }
 
+int DrmEventListener::AddFd(int fd, DrmEventHandler *handler) {
+  AutoLock lock(&handlers_lock_, "drm-event-handlers");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  ret = AddToEpoll(epoll_fd_.get(), fd);
+  if (ret)
+    return ret;
+  fd_handlers_[fd] = handler;
+  return 0;
+}
+
+void DrmEventListener::RemoveFd(int fd) {
+  AutoLock lock(&handlers_lock_, "drm-event-handlers");
+  if (lock.Lock())
+    return;
+
+  if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_DEL, fd, NULL))
+    ALOGE("Failed to remove fd %d from epoll %d", fd, -errno);
+  fd_handlers_.erase(fd);
+}
+
+void DrmEventListener::RegisterVBlankHandler(DrmVBlankHandler *handler) {
+  AutoLock lock(&handlers_lock_, "drm-event-handlers");
+  if (lock.Lock())
+    return;
+  vblank_handlers_.insert(handler);
+}
+
+void DrmEventListener::UnregisterVBlankHandler(DrmVBlankHandler *handler) {
+  AutoLock lock(&handlers_lock_, "drm-event-handlers");
+  if (lock.Lock())
+    return;
+  vblank_handlers_.erase(handler);
+}
+
+int DrmEventListener::RequestVBlank(int pipe, DrmVBlankHandler *handler) {
+  uint32_t high_crtc = (pipe << DRM_VBLANK_HIGH_CRTC_SHIFT);
+
+  // Freed once the event arrives. The kernel drops pending events only
+  // along with the drm fd.
+  VBlankRequest *request = new VBlankRequest{this, handler};
+
+  drmVBlank vblank;
+  memset(&vblank, 0, sizeof(vblank));
+  vblank.request.type = (drmVBlankSeqType)(
+      DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT |
+      (high_crtc & DRM_VBLANK_HIGH_CRTC_MASK));
+  vblank.request.sequence = 1;
+  vblank.request.signal = (unsigned long)request;
+
+  int ret = drmWaitVBlank(drm_->fd(), &vblank);
+  if (ret) {
+    delete request;
+    return ret;
+  }
+  return 0;
+}
+
 void DrmEventListener::FlipHandler(int /* fd */, unsigned int /* sequence */,
                                    unsigned int tv_sec, unsigned int tv_usec,
                                    void *user_data) {
@@ -78,6 +192,35 @@ void DrmEventListener::FlipHandler(int /* fd */, unsigned int /* sequence */,
   delete handler;
 }
 
+void DrmEventListener::VBlankHandler(int /* fd */, unsigned int sequence,
+                                     unsigned int tv_sec, unsigned int tv_usec,
+                                     void *user_data) {
+  VBlankRequest *request = (VBlankRequest *)user_data;
+  if (!request)
+    return;
+
+  int64_t timestamp_ns = (int64_t)tv_sec * 1000 * 1000 * 1000 +
+                         (int64_t)tv_usec * 1000;
+  request->listener->DispatchVBlank(request->handler, sequence, timestamp_ns);
+  delete request;
+}
+
+void DrmEventListener::DispatchVBlank(DrmVBlankHandler *handler,
+                                      unsigned int sequence,
+                                      int64_t timestamp_ns) {
+  int64_t latency_ns = GetTimeNs() - timestamp_ns;
+  dump_vblanks_++;
+  dump_vblank_latency_total_ns_ += latency_ns;
+  dump_vblank_latency_max_ns_ =
+      std::max(dump_vblank_latency_max_ns_, latency_ns);
+
+  AutoLock lock(&handlers_lock_, "drm-event-handlers");
+  if (lock.Lock())
+    return;
+  if (vblank_handlers_.count(handler))
+    handler->HandleVBlank(sequence, timestamp_ns);
+}
+
 void DrmEventListener::UEventHandler() {
   char buffer[1024];
   int ret;
@@ -91,13 +234,15 @@ void DrmEventListener::UEventHandler() {
     ALOGE("Failed to get monotonic clock on hotplug %d", ret);
 
   while (true) {
-    ret = read(uevent_fd_.get(), &buffer, sizeof(buffer));
+    ret = read(uevent_fd_.get(), &buffer, sizeof(buffer) - 1);
     if (ret == 0) {
       return;
     } else if (ret < 0) {
-      ALOGE("Got error reading uevent %d", ret);
+      if (errno != EAGAIN)
+        ALOGE("Got error reading uevent %d", -errno);
       return;
     }
+    buffer[ret] = '\0';
 
     if (!hotplug_handler_)
       continue;
@@ -105,34 +250,77 @@ void DrmEventListener::UEventHandler() {
     bool drm_event = false, hotplug_event = false;
     for (int i = 0; i < ret;) {
       char *event = buffer + i;
-      if (strcmp(event, "DEVTYPE=drm_minor"))
+      if (!strcmp(event, "DEVTYPE=drm_minor"))
         drm_event = true;
-      else if (strcmp(event, "HOTPLUG=1"))
+      else if (!strcmp(event, "HOTPLUG=1"))
         hotplug_event = true;
 
       i += strlen(event) + 1;
     }
 
-    if (drm_event && hotplug_event)
+    if (drm_event && hotplug_event) {
+      dump_hotplugs_++;
       hotplug_handler_->HandleEvent(timestamp);
+    }
   }
 }
 
 void DrmEventListener::Routine() {
-  int ret;
+  struct epoll_event events[kMaxEvents];
+  int count;
   do {
-    ret = select(max_fd_ + 1, &fds_, NULL, NULL, NULL);
-  } while (ret == -1 && errno == EINTR);
-
-  if (FD_ISSET(drm_->fd(), &fds_)) {
-    drmEventContext event_context = {
-        .version = DRM_EVENT_CONTEXT_VERSION,
-        .vblank_handler = NULL,
-        .page_flip_handler = DrmEventListener::FlipHandler};
-    drmHandleEvent(drm_->fd(), &event_context);
+    count = epoll_wait(epoll_fd_.get(), events, kMaxEvents, -1);
+  } while (count < 0 && errno == EINTR);
+  if (count < 0) {
+    ALOGE("Failed to wait for events %d", -errno);
+    return;
   }
+  dump_wakeups_++;
 
-  if (FD_ISSET(uevent_fd_.get(), &fds_))
-    UEventHandler();
+  for (int i = 0; i < count; i++) {
+    int fd = events[i].data.fd;
+    if (fd == drm_->fd()) {
+      dump_drm_events_++;
+      drmEventContext event_context = {
+          .version = DRM_EVENT_CONTEXT_VERSION,
+          .vblank_handler = DrmEventListener::VBlankHandler,
+          .page_flip_handler = DrmEventListener::FlipHandler};
+      drmHandleEvent(drm_->fd(), &event_context);
+    } else if (fd == uevent_fd_.get()) {
+      UEventHandler();
+    } else if (fd == wake_fd_.get()) {
+      // Only wakes the thread up to notice it should exit
+      uint64_t value;
+      read(wake_fd_.get(), &value, sizeof(value));
+    } else {
+      AutoLock lock(&handlers_lock_, "drm-event-handlers");
+      if (lock.Lock())
+        continue;
+      auto it = fd_handlers_.find(fd);
+      if (it == fd_handlers_.end())
+        continue;
+      dump_fd_events_++;
+      it->second->HandleEvent(GetTimeNs() / 1000);
+    }
+  }
+}
+
+void DrmEventListener::Dump(std::ostringstream *out) const {
+  uint64_t vblanks = dump_vblanks_;
+  *out << "DRM event listener: wakeups=" << dump_wakeups_
+       << " drm_events=" << dump_drm_events_ << " vblanks=" << vblanks
+       << " hotplugs=" << dump_hotplugs_ << " fd_events=" << dump_fd_events_;
+  if (vblanks)
+    *out << " vblank_latency_us[avg/max]="
+         << dump_vblank_latency_total_ns_ / (int64_t)vblanks / 1000 << "/"
+         << dump_vblank_latency_max_ns_ / 1000;
+  *out << "\n";
+  DumpScheduling(out);
+
+  AutoLock lock(&handlers_lock_, "drm-event-handlers");
+  if (lock.Lock())
+    return;
+  *out << "  handlers: fds=" << fd_handlers_.size()
+       << " vblank=" << vblank_handlers_.size() << "\n";
 }
 }
@@ -20,6 +20,12 @@
 #include "autofd.h"
 #include "worker.h"
 
+#include <pthread.h>
+
+#include <map>
+#include <set>
+#include <sstream>
+
 namespace android {
 
 class DrmResources;
@@ -34,16 +40,44 @@ class DrmEventHandler {
   virtual void HandleEvent(uint64_t timestamp_us) = 0;
 };
 
+class DrmVBlankHandler {
+ public:
+  virtual ~DrmVBlankHandler() {
+  }
+
+  virtual void HandleVBlank(unsigned int sequence, int64_t timestamp_ns) = 0;
+};
+
+// The one thread waiting on DRM events, uevents and any other fds that need
+// to be handled promptly, such as timers, for all displays. Handlers run on
+// that thread and must not block.
 class DrmEventListener : public Worker {
  public:
   DrmEventListener(DrmResources *drm);
   virtual ~DrmEventListener() {
+    pthread_mutex_destroy(&handlers_lock_);
   }
 
   int Init();
+  // Hides Worker::Exit to wake the thread up first
+  int Exit();
 
   void RegisterHotplugHandler(DrmEventHandler *handler);
 
+  // handler is called whenever fd becomes readable, and has to consume what
+  // made it readable. It's safe to destroy handler once RemoveFd returns.
+  int AddFd(int fd, DrmEventHandler *handler);
+  void RemoveFd(int fd);
+
+  // Requests a DRM event for the next vblank of the crtc at pipe, delivered to
+  // handler. Handlers have to be registered first, and events arriving after
+  // they were unregistered are dropped.
+  void RegisterVBlankHandler(DrmVBlankHandler *handler);
+  void UnregisterVBlankHandler(DrmVBlankHandler *handler);
+  int RequestVBlank(int pipe, DrmVBlankHandler *handler);
+
+  void Dump(std::ostringstream *out) const;
+
   static void FlipHandler(int fd, unsigned int sequence, unsigned int tv_sec,
                           unsigned int tv_usec, void *user_data);
 
@@ -51,14 +85,39 @@ class DrmEventListener : public Worker {
   virtual void Routine();
 
  private:
+  struct VBlankRequest {
+    DrmEventListener *listener;
+    DrmVBlankHandler *handler;
+  };
+
+  static const int kMaxEvents = 8;
+
+  static void VBlankHandler(int fd, unsigned int sequence, unsigned int tv_sec,
+                            unsigned int tv_usec, void *user_data);
+  void DispatchVBlank(DrmVBlankHandler *handler, unsigned int sequence,
+                      int64_t timestamp_ns);
   void UEventHandler();
 
-  fd_set fds_;
+  UniqueFd epoll_fd_;
   UniqueFd uevent_fd_;
-  int max_fd_ = -1;
+  UniqueFd wake_fd_;
 
   DrmResources *drm_;
   DrmEventHandler *hotplug_handler_ = NULL;
+
+  // Held while dispatching to handlers, so they can't go away meanwhile
+  mutable pthread_mutex_t handlers_lock_;
+  std::map<int, DrmEventHandler *> fd_handlers_;
+  std::set<DrmVBlankHandler *> vblank_handlers_;
+
+  // Only touched on the event thread, and read racily by Dump()
+  uint64_t dump_wakeups_ = 0;
+  uint64_t dump_drm_events_ = 0;
+  uint64_t dump_vblanks_ = 0;
+  uint64_t dump_hotplugs_ = 0;
+  uint64_t dump_fd_events_ = 0;
+  int64_t dump_vblank_latency_total_ns_ = 0;
+  int64_t dump_vblank_latency_max_ns_ = 0;
 };
 }
 
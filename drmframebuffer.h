@@ -23,10 +23,30 @@
 
 #include <ui/GraphicBuffer.h>
 
+#include "drmhwcomposer.h"
+
 namespace android {
 
 struct DrmFramebuffer {
-  DrmFramebuffer() : release_fence_fd_(-1) {
+  DrmFramebuffer() : release_fence_fd_(-1), display_frame_(0, 0, 0, 0) {
+  }
+
+  DrmFramebuffer(const DrmFramebuffer &) = delete;
+  DrmFramebuffer(DrmFramebuffer &&rhs)
+      : buffer_(rhs.buffer_),
+        release_fence_fd_(rhs.release_fence_fd_),
+        display_frame_(rhs.display_frame_) {
+    rhs.buffer_.clear();
+    rhs.release_fence_fd_ = -1;
+  }
+
+  DrmFramebuffer &operator=(DrmFramebuffer &&rhs) {
+    set_release_fence_fd(rhs.release_fence_fd_);
+    rhs.release_fence_fd_ = -1;
+    buffer_ = rhs.buffer_;
+    rhs.buffer_.clear();
+    display_frame_ = rhs.display_frame_;
+    return *this;
   }
 
   ~DrmFramebuffer() {
@@ -38,7 +58,7 @@ struct DrmFramebuffer {
     return buffer_ != NULL;
   }
 
-  sp<GraphicBuffer> buffer() {
+  sp<GraphicBuffer> buffer() const {
     return buffer_;
   }
 
@@ -52,20 +72,28 @@ struct DrmFramebuffer {
     release_fence_fd_ = fd;
   }
 
-  bool Allocate(uint32_t w, uint32_t h) {
+  // The area of the display the buffer was last rendered for. Its top left
+  // corner maps to the top left corner of the buffer, which may be larger.
+  const DrmHwcRect<int> &display_frame() const {
+    return display_frame_;
+  }
+
+  void set_display_frame(const DrmHwcRect<int> &display_frame) {
+    display_frame_ = display_frame;
+  }
+
+  // Scanout holds its own reference to the buffer, so a buffer of the wrong
+  // size is dropped without waiting for the display to release it
+  bool Allocate(uint32_t w, uint32_t h,
+                PixelFormat format = PIXEL_FORMAT_RGBA_8888) {
     if (is_valid()) {
-      if (buffer_->getWidth() == w && buffer_->getHeight() == h)
+      if (buffer_->getWidth() == w && buffer_->getHeight() == h &&
+          buffer_->getPixelFormat() == format)
         return true;
 
-      if (release_fence_fd_ >= 0) {
-        if (sync_wait(release_fence_fd_, kReleaseWaitTimeoutMs) != 0) {
-          ALOGE("Wait for release fence failed\n");
-          return false;
-        }
-      }
       Clear();
     }
-    buffer_ = new GraphicBuffer(w, h, PIXEL_FORMAT_RGBA_8888,
+    buffer_ = new GraphicBuffer(w, h, format,
                                 GRALLOC_USAGE_HW_FB | GRALLOC_USAGE_HW_RENDER |
                                     GRALLOC_USAGE_HW_COMPOSER);
     release_fence_fd_ = -1;
@@ -84,6 +112,18 @@ struct DrmFramebuffer {
     buffer_.clear();
   }
 
+  // Hands the release fence over to the caller, who has to make sure the
+  // display is done with the buffer before writing to it
+  int TakeReleaseFence() {
+    int fd = release_fence_fd_;
+    release_fence_fd_ = -1;
+    return fd;
+  }
+
+  bool is_released() {
+    return WaitReleased(0) == 0;
+  }
+
   int WaitReleased(int timeout_milliseconds) {
     if (!is_valid())
       return 0;
@@ -94,13 +134,10 @@ struct DrmFramebuffer {
     return ret;
   }
 
-  // Somewhat arbitrarily chosen, but wanted to stay below 3000ms, which is the
-  // system timeout
-  static const int kReleaseWaitTimeoutMs = 1500;
-
  private:
   sp<GraphicBuffer> buffer_;
   int release_fence_fd_;
+  DrmHwcRect<int> display_frame_;
 };
 }
 
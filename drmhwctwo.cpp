@@ -24,6 +24,9 @@
 #include "vsyncworker.h"
 
 #include <inttypes.h>
+#include <string.h>
+#include <algorithm>
+#include <sstream>
 #include <string>
 
 #include <cutils/log.h>
@@ -122,8 +125,20 @@ HWC2::Error DrmHwcTwo::DestroyVirtualDisplay(hwc2_display_t display) {
 }
 
 void DrmHwcTwo::Dump(uint32_t *size, char *buffer) {
-  // TODO: Implement dump
-  unsupported(__func__, size, buffer);
+  supported(__func__);
+  if (buffer) {
+    *size = std::min((size_t)*size, dump_string_.size());
+    memcpy(buffer, dump_string_.data(), *size);
+    return;
+  }
+
+  std::ostringstream out;
+  drm_.event_listener()->Dump(&out);
+  for (const std::pair<const hwc2_display_t, DrmHwcTwo::HwcDisplay> &d :
+       displays_)
+    d.second.Dump(&out);
+  dump_string_ = out.str();
+  *size = dump_string_.size();
 }
 
 uint32_t DrmHwcTwo::GetMaxVirtualDisplayCount() {
@@ -224,13 +239,30 @@ HWC2::Error DrmHwcTwo::HwcDisplay::Init(std::vector<DrmPlane *> *planes) {
   if (err != HWC2::Error::None)
     return err;
 
+  // Unless the display is already showing one of its modes, which keeps the
+  // first frame from needing a modeset
+  if (crtc_->mode_valid()) {
+    for (const DrmMode &mode : connector_->modes()) {
+      if (mode == crtc_->mode()) {
+        default_config = mode.id();
+        break;
+      }
+    }
+  }
+
   ret = vsync_worker_.Init(drm_, display);
   if (ret) {
     ALOGE("Failed to create event worker for d=%d %d\n", display, ret);
     return HWC2::Error::BadDisplay;
   }
+  compositor_.SetVSyncModel(vsync_worker_.model());
+
+  err = SetActiveConfig(default_config);
+  if (err != HWC2::Error::None)
+    return err;
 
-  return SetActiveConfig(default_config);
+  compositor_.StartPrewarm();
+  return HWC2::Error::None;
 }
 
 HWC2::Error DrmHwcTwo::HwcDisplay::RegisterVsyncCallback(
@@ -245,6 +277,12 @@ HWC2::Error DrmHwcTwo::HwcDisplay::RegisterVsyncCallback(
   return HWC2::Error::None;
 }
 
+void DrmHwcTwo::HwcDisplay::Dump(std::ostringstream *out) const {
+  *out << "Display " << handle_ << ":\n";
+  vsync_worker_.Dump(out);
+  compositor_.Dump(out);
+}
+
 HWC2::Error DrmHwcTwo::HwcDisplay::AcceptDisplayChanges() {
   supported(__func__);
   uint32_t num_changes = 0;
@@ -684,6 +722,9 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetPowerMode(int32_t mode_in) {
     ALOGE("Failed to apply the dpms composition ret=%d", ret);
     return HWC2::Error::BadParameter;
   }
+  // The display's timing may have shifted while it was off
+  if (mode == HWC2::PowerMode::On)
+    vsync_worker_.ResetModel();
   return HWC2::Error::None;
 }
 
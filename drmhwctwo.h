@@ -23,6 +23,8 @@
 #include <hardware/hwcomposer2.h>
 
 #include <map>
+#include <sstream>
+#include <string>
 
 namespace android {
 
@@ -143,6 +145,7 @@ class DrmHwcTwo : public hwc2_device_t {
 
     HWC2::Error RegisterVsyncCallback(hwc2_callback_data_t data,
                                       hwc2_function_pointer_t func);
+    void Dump(std::ostringstream *out) const;
 
     // HWC Hooks
     HWC2::Error AcceptDisplayChanges();
@@ -268,5 +271,9 @@ class DrmHwcTwo : public hwc2_device_t {
   const gralloc_module_t *gralloc_;
   std::map<hwc2_display_t, HwcDisplay> displays_;
   std::map<HWC2::Callback, HwcCallback> callbacks_;
+
+  // Filled by the first call to Dump, which only asks for its size, and
+  // handed out by the second
+  std::string dump_string_;
 };
 }
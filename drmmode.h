@@ -29,6 +29,8 @@ class DrmMode {
   DrmMode(drmModeModeInfoPtr m);
 
   bool operator==(const drmModeModeInfo &m) const;
+  // Whether both have the same timings, regardless of id, type and name
+  bool operator==(const DrmMode &m) const;
   void ToDrmModeModeInfo(drm_mode_modeinfo *m) const;
 
   uint32_t id() const;
@@ -49,6 +49,7 @@ class DrmPlane {
   uint32_t type() const;
 
   bool CanCompositeLayer(const DrmHwcLayer &layer);
+  bool IsSupportedFormat(uint32_t format);
 
   const DrmProperty &crtc_property() const;
   const DrmProperty &fb_property() const;
@@ -67,8 +68,6 @@ class DrmPlane {
   void Dump() const;
 
  private:
-  bool IsSupportedFormat(uint32_t format);
-
   DrmResources *drm_;
   uint32_t id_;
 
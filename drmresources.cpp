@@ -27,22 +27,36 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <time.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include <thread>
+
 #include <cutils/log.h>
 #include <cutils/properties.h>
 
 namespace android {
 
+static int64_t GetTimeNs() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+  return ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
 DrmResources::DrmResources() : event_listener_(this) {
 }
 
 DrmResources::~DrmResources() {
   event_listener_.Exit();
+  ClearPropertyCache();
 }
 
 int DrmResources::Init() {
+  int64_t init_start_ns = GetTimeNs();
+  share_object_properties_ = true;
+
   char path[PROPERTY_VALUE_MAX];
   property_get("hwc.drm.device", path, "/dev/dri/card0");
 
@@ -124,12 +138,62 @@ int DrmResources::Init() {
     encoders_.emplace_back(std::move(enc));
   }
 
-  for (int i = 0; !ret && i < res->count_connectors; ++i) {
-    drmModeConnectorPtr c = drmModeGetConnector(fd(), res->connectors[i]);
+  // Probing a connector may read its EDID, which takes a while, so they are
+  // all probed at once while the planes are set up
+  std::vector<drmModeConnectorPtr> probed_connectors(res->count_connectors,
+                                                     NULL);
+  std::vector<std::thread> probes;
+  for (int i = 0; !ret && i < res->count_connectors; ++i)
+    probes.emplace_back([this, res, i, &probed_connectors]() {
+      probed_connectors[i] = drmModeGetConnector(fd(), res->connectors[i]);
+    });
+
+  drmModePlaneResPtr plane_res = NULL;
+  if (!ret) {
+    plane_res = drmModeGetPlaneResources(fd());
+    if (!plane_res) {
+      ALOGE("Failed to get plane resources");
+      ret = -ENOENT;
+    }
+  }
+
+  for (uint32_t i = 0; plane_res && !ret && i < plane_res->count_planes; ++i) {
+    drmModePlanePtr p = drmModeGetPlane(fd(), plane_res->planes[i]);
+    if (!p) {
+      ALOGE("Failed to get plane %d", plane_res->planes[i]);
+      ret = -ENODEV;
+      break;
+    }
+
+    std::unique_ptr<DrmPlane> plane(new DrmPlane(this, p));
+
+    drmModeFreePlane(p);
+
+    ret = plane->Init();
+    if (ret) {
+      ALOGE("Init plane %d failed", plane_res->planes[i]);
+      break;
+    }
+
+    planes_.emplace_back(std::move(plane));
+  }
+  if (plane_res)
+    drmModeFreePlaneResources(plane_res);
+
+  for (std::thread &probe : probes)
+    probe.join();
+
+  for (int i = 0; i < (int)probed_connectors.size(); ++i) {
+    drmModeConnectorPtr c = probed_connectors[i];
+    if (ret) {
+      if (c)
+        drmModeFreeConnector(c);
+      continue;
+    }
     if (!c) {
       ALOGE("Failed to get connector %d", res->connectors[i]);
       ret = -ENODEV;
-      break;
+      continue;
     }
 
     std::vector<DrmEncoder *> possible_encoders;
@@ -151,7 +215,7 @@ int DrmResources::Init() {
     ret = conn->Init();
     if (ret) {
       ALOGE("Init connector %d failed", res->connectors[i]);
-      break;
+      continue;
     }
 
     if (conn->state() == DRM_MODE_CONNECTED && conn->built_in() &&
@@ -168,39 +232,17 @@ int DrmResources::Init() {
   if (res)
     drmModeFreeResources(res);
 
+  share_object_properties_ = false;
+  ClearPropertyCache();
+
   // Catch-all for the above loops
   if (ret)
     return ret;
 
-  drmModePlaneResPtr plane_res = drmModeGetPlaneResources(fd());
-  if (!plane_res) {
-    ALOGE("Failed to get plane resources");
-    return -ENOENT;
-  }
-
-  for (uint32_t i = 0; i < plane_res->count_planes; ++i) {
-    drmModePlanePtr p = drmModeGetPlane(fd(), plane_res->planes[i]);
-    if (!p) {
-      ALOGE("Failed to get plane %d", plane_res->planes[i]);
-      ret = -ENODEV;
-      break;
-    }
-
-    std::unique_ptr<DrmPlane> plane(new DrmPlane(this, p));
-
-    drmModeFreePlane(p);
-
-    ret = plane->Init();
-    if (ret) {
-      ALOGE("Init plane %d failed", plane_res->planes[i]);
-      break;
-    }
-
-    planes_.emplace_back(std::move(plane));
-  }
-  drmModeFreePlaneResources(plane_res);
-  if (ret)
-    return ret;
+  ALOGI("Probed %zu crtcs, %zu planes and %zu connectors in %" PRId64
+        "ms with %" PRIu64 " property ioctls",
+        crtcs_.size(), planes_.size(), connectors_.size(),
+        (GetTimeNs() - init_start_ns) / (1000 * 1000), property_ioctls_);
 
   ret = event_listener_.Init();
   if (ret) {
@@ -345,26 +387,61 @@ DrmEventListener *DrmResources::event_listener() {
 
 int DrmResources::GetProperty(uint32_t obj_id, uint32_t obj_type,
                               const char *prop_name, DrmProperty *property) {
-  drmModeObjectPropertiesPtr props;
+  PropertyTable fetched;
+  PropertyTable *table = &fetched;
+  auto shared = object_properties_.find(obj_id);
+  if (shared != object_properties_.end()) {
+    table = &shared->second;
+  } else {
+    drmModeObjectPropertiesPtr props =
+        drmModeObjectGetProperties(fd(), obj_id, obj_type);
+    property_ioctls_++;
+    if (!props) {
+      ALOGE("Failed to get properties for %d/%x", obj_id, obj_type);
+      return -ENODEV;
+    }
 
-  props = drmModeObjectGetProperties(fd(), obj_id, obj_type);
-  if (!props) {
-    ALOGE("Failed to get properties for %d/%x", obj_id, obj_type);
-    return -ENODEV;
+    for (uint32_t i = 0; i < props->count_props; ++i) {
+      drmModePropertyPtr p = GetPropertyInfo(props->props[i]);
+      if (p)
+        fetched[p->name] =
+            std::make_pair(props->props[i], props->prop_values[i]);
+    }
+    drmModeFreeObjectProperties(props);
+
+    if (share_object_properties_)
+      table = &object_properties_.emplace(obj_id, std::move(fetched))
+                   .first->second;
   }
 
-  bool found = false;
-  for (int i = 0; !found && (size_t)i < props->count_props; ++i) {
-    drmModePropertyPtr p = drmModeGetProperty(fd(), props->props[i]);
-    if (!strcmp(p->name, prop_name)) {
-      property->Init(p, props->prop_values[i]);
-      found = true;
-    }
-    drmModeFreeProperty(p);
+  auto entry = table->find(prop_name);
+  if (entry == table->end())
+    return -ENOENT;
+
+  property->Init(property_info_[entry->second.first], entry->second.second);
+  return 0;
+}
+
+drmModePropertyPtr DrmResources::GetPropertyInfo(uint32_t prop_id) {
+  auto info = property_info_.find(prop_id);
+  if (info != property_info_.end())
+    return info->second;
+
+  drmModePropertyPtr p = drmModeGetProperty(fd(), prop_id);
+  property_ioctls_++;
+  if (!p) {
+    ALOGE("Failed to get property %d", prop_id);
+    return NULL;
   }
+  property_info_[prop_id] = p;
+  return p;
+}
 
-  drmModeFreeObjectProperties(props);
-  return found ? 0 : -ENOENT;
+void DrmResources::ClearPropertyCache() {
+  for (auto &info : property_info_)
+    drmModeFreeProperty(info.second);
+  property_info_.clear();
+  object_properties_.clear();
 }
 
 int DrmResources::GetPlaneProperty(const DrmPlane &plane, const char *prop_name,
@@ -24,6 +24,9 @@
 #include "drmplane.h"
 
 #include <stdint.h>
+#include <map>
+#include <string>
+#include <utility>
 
 namespace android {
 
@@ -74,8 +77,15 @@ class DrmResources {
 
  private:
   int TryEncoderForDisplay(int display, DrmEncoder *enc);
+  // Properties of an object by name, as property id and value
+  typedef std::map<std::string, std::pair<uint32_t, uint64_t>> PropertyTable;
+
   int GetProperty(uint32_t obj_id, uint32_t obj_type, const char *prop_name,
                   DrmProperty *property);
+  drmModePropertyPtr GetPropertyInfo(uint32_t prop_id);
+  // Frees the tables once Init() is done with them. Descriptions looked up
+  // afterwards are kept until the destructor, as they never change.
+  void ClearPropertyCache();
 
   int CreateDisplayPipe(DrmConnector *connector);
 
@@ -90,6 +100,16 @@ class DrmResources {
 
   std::pair<uint32_t, uint32_t> min_resolution_;
   std::pair<uint32_t, uint32_t> max_resolution_;
+
+  // Every object's properties are fetched at once the first time one of them
+  // is looked up. During Init() the values are kept for the lookups that
+  // follow, later on each lookup fetches them anew so they're never stale.
+  // Objects of a type share their property ids, so the description of each id
+  // is only fetched once.
+  std::map<uint32_t, PropertyTable> object_properties_;
+  bool share_object_properties_ = false;
+  std::map<uint32_t, drmModePropertyPtr> property_info_;
+  uint64_t property_ioctls_ = 0;
 };
 }
 
@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-gl-compositor-worker"
+
+#include "glcompositorworker.h"
+#include "autolock.h"
+#include "drmdisplaycomposition.h"
+#include "glworker.h"
+#include "synctimeline.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include <cutils/log.h>
+#include <hardware/hardware.h>
+#include <sync/sync.h>
+#include <system/thread_defs.h>
+
+namespace android {
+
+static int64_t GetTimeNs() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+  return ts.tv_sec * 1000LL * 1000 * 1000 + ts.tv_nsec;
+}
+
+GLCompositorWorker::GLCompositorWorker()
+    : Worker("gl-compositor", HAL_PRIORITY_URGENT_DISPLAY),
+      jobs_queued_(0),
+      jobs_done_(0),
+      releases_pending_(0),
+      exiting_(false),
+      init_ret_(-ENODEV),
+      init_start_ns_(0),
+      init_done_(false),
+      init_boosted_(false),
+      init_tid_(0),
+      average_composite_time_ns_(0) {
+  pthread_mutex_init(&queue_lock_, NULL);
+  pthread_cond_init(&queue_cond_, NULL);
+}
+
+GLCompositorWorker::~GLCompositorWorker() {
+  if (initialized()) {
+    // The compositor has to be destroyed on the thread its context is current
+    Job job;
+    job.type = JobType::kDestroy;
+    QueueJob(std::move(job), true);
+
+    // The thread waits for jobs rather than for a signal, so it has to be
+    // woken up before Exit() can join it
+    pthread_mutex_lock(&queue_lock_);
+    exiting_ = true;
+    WakeLocked();
+    pthread_mutex_unlock(&queue_lock_);
+    Exit();
+  }
+
+  pthread_cond_destroy(&queue_cond_);
+  pthread_mutex_destroy(&queue_lock_);
+}
+
+int GLCompositorWorker::InitAsync() {
+  wake_fd_.Set(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+  if (wake_fd_.get() < 0) {
+    ALOGE("Failed to create wake eventfd %d", -errno);
+    return -errno;
+  }
+
+  int ret = InitWorker();
+  if (ret)
+    return ret;
+
+  init_start_ns_ = GetTimeNs();
+  Job job;
+  job.type = JobType::kInit;
+  return QueueJob(std::move(job), false);
+}
+
+int GLCompositorWorker::WaitForInit() {
+  if (init_done_.load())
+    return init_ret_;
+
+  // Whatever waits for initialization shouldn't be held up by it running at
+  // background priority
+  init_boosted_.store(true);
+  if (init_tid_.load())
+    SetBackground(false);
+
+  int64_t wait_start_ns = GetTimeNs();
+  AutoLock lock(&queue_lock_, "gl-compositor");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+  while (!init_done_.load() && !exiting_)
+    pthread_cond_wait(&queue_cond_, &queue_lock_);
+  lock.Unlock();
+
+  ALOGI("Waited %" PRId64 "ms for GL compositor init",
+        (GetTimeNs() - wait_start_ns) / (1000 * 1000));
+  return init_done_.load() ? init_ret_ : -EINTR;
+}
+
+int GLCompositorWorker::Init() {
+  int ret = InitAsync();
+  if (ret)
+    return ret;
+  return WaitForInit();
+}
+
+int GLCompositorWorker::Composite(DrmDisplayComposition *composition,
+                                  bool squash,
+                                  const sp<GraphicBuffer> &framebuffer,
+                                  UniqueFd framebuffer_fence,
+                                  const DrmHwcRect<int> &frame, float scale,
+                                  UniqueFd *out_fence) {
+  int composite_ret = -EINTR;
+  Job job;
+  job.composition = composition;
+  job.squash = squash;
+  job.framebuffer = framebuffer;
+  job.framebuffer_fence = std::move(framebuffer_fence);
+  job.frame = frame;
+  job.scale = scale;
+  job.ret = &composite_ret;
+  job.render_fence = out_fence;
+
+  int ret = QueueJob(std::move(job), true);
+  return ret ? ret : composite_ret;
+}
+
+int GLCompositorWorker::QueueReleaseFramebuffers() {
+  Job job;
+  job.type = JobType::kReleaseFramebuffers;
+  return QueueJob(std::move(job), false);
+}
+
+void GLCompositorWorker::Finish() {
+  AutoLock lock(&queue_lock_, "gl-compositor");
+  if (lock.Lock())
+    return;
+
+  uint64_t queued = jobs_queued_;
+  while ((jobs_done_ < queued || releases_pending_) && !exiting_)
+    pthread_cond_wait(&queue_cond_, &queue_lock_);
+}
+
+int GLCompositorWorker::QueueJob(Job &&job, bool wait) {
+  AutoLock lock(&queue_lock_, "gl-compositor");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  while (queue_.size() >= kMaxQueueDepth && !exiting_)
+    pthread_cond_wait(&queue_cond_, &queue_lock_);
+  if (exiting_)
+    return -EINTR;
+
+  queue_.emplace_back(std::move(job));
+  uint64_t seq = ++jobs_queued_;
+  WakeLocked();
+
+  if (!wait)
+    return 0;
+  while (jobs_done_ < seq && !exiting_)
+    pthread_cond_wait(&queue_cond_, &queue_lock_);
+  return jobs_done_ < seq ? -EINTR : 0;
+}
+
+void GLCompositorWorker::WakeLocked() {
+  pthread_cond_broadcast(&queue_cond_);
+  uint64_t value = 1;
+  if (write(wake_fd_.get(), &value, sizeof(value)) < 0)
+    ALOGE("Failed to wake GL compositor %d", -errno);
+}
+
+void GLCompositorWorker::WaitLocked(AutoLock *lock) {
+  struct pollfd fds[2];
+  fds[0].fd = wake_fd_.get();
+  fds[0].events = POLLIN;
+  nfds_t count = 1;
+  int timeout_ms = -1;
+  if (!pending_releases_.empty()) {
+    PendingRelease &release = pending_releases_.front();
+    int64_t waited_ms = (GetTimeNs() - release.start_ns) / (1000 * 1000);
+    timeout_ms = std::max<int64_t>(kRenderWaitTimeoutMs - waited_ms, 0);
+    fds[1].fd = release.render_fence.get();
+    fds[1].events = POLLIN;
+    count = 2;
+  }
+  lock->Unlock();
+
+  int ret = poll(fds, count, timeout_ms);
+  if (ret < 0 && errno != EINTR)
+    ALOGE("Failed to wait for GL rendering or jobs %d", -errno);
+  if (ret > 0 && (fds[0].revents & POLLIN)) {
+    uint64_t value;
+    read(wake_fd_.get(), &value, sizeof(value));
+  }
+
+  lock->Lock();
+}
+
+void GLCompositorWorker::Routine() {
+  ReleaseRendered(false);
+
+  AutoLock lock(&queue_lock_, "gl-compositor");
+  int ret = lock.Lock();
+  if (ret) {
+    ALOGE("Failed to lock worker, %d", ret);
+    return;
+  }
+  releases_pending_ = pending_releases_.size();
+  pthread_cond_broadcast(&queue_cond_);
+  if (exiting_)
+    return;
+
+  if (queue_.empty()) {
+    // Shader variants the driver can't compile in the background are built
+    // while there's nothing to composite, one at a time so new jobs don't
+    // wait for more than one of them
+    if (compositor_) {
+      lock.Unlock();
+      if (compositor_->BuildDeferredVariant())
+        return;
+      if (lock.Lock())
+        return;
+    }
+    if (queue_.empty() && !exiting_)
+      WaitLocked(&lock);
+    return;
+  }
+
+  Job job = std::move(queue_.front());
+  queue_.pop_front();
+  pthread_cond_broadcast(&queue_cond_);
+  lock.Unlock();
+
+  RunJob(&job);
+
+  if (lock.Lock())
+    return;
+  jobs_done_++;
+  releases_pending_ = pending_releases_.size();
+  pthread_cond_broadcast(&queue_cond_);
+}
+
+void GLCompositorWorker::CompositeJob(Job *job) {
+  DrmDisplayComposition *composition = job->composition;
+  std::vector<DrmCompositionRegion> &regions =
+      job->squash ? composition->squash_regions()
+                  : composition->pre_comp_regions();
+
+  PendingRelease release;
+  release.framebuffer = job->framebuffer;
+  release.start_ns = GetTimeNs();
+
+  int ret = -ENODEV;
+  if (compositor_) {
+    ret = compositor_->Composite(composition->layers().data(), regions.data(),
+                                 regions.size(), job->framebuffer,
+                                 std::move(job->framebuffer_fence), job->frame,
+                                 job->scale, composition->importer(),
+                                 &release.render_fence);
+    compositor_->Finish();
+  }
+  if (!ret && release.render_fence.get() >= 0) {
+    // The plane waits on the GPU's own fence, the worker only watches it to
+    // release the source layers
+    job->render_fence->Set(dup(release.render_fence.get()));
+    if (job->render_fence->get() < 0) {
+      ret = -errno;
+      ALOGE("Failed to dup render fence %d", ret);
+    }
+  }
+  *job->ret = ret;
+  if (ret) {
+    // The frame fails, which releases the source layers along with it
+    ALOGE("Failed to composite layers %d", ret);
+    return;
+  }
+
+  if (!composition->TakeStagePoint(job->squash, &release.timeline,
+                                   &release.point))
+    return;
+  // Without a native fence the GPU was already waited for
+  if (release.render_fence.get() < 0) {
+    Release(&release, true);
+    return;
+  }
+  pending_releases_.emplace_back(std::move(release));
+}
+
+void GLCompositorWorker::ReleaseRendered(bool wait) {
+  while (!pending_releases_.empty()) {
+    PendingRelease &release = pending_releases_.front();
+    int64_t waited_ms = (GetTimeNs() - release.start_ns) / (1000 * 1000);
+    int timeout_ms =
+        wait ? std::max<int64_t>(kRenderWaitTimeoutMs - waited_ms, 0) : 0;
+    int ret = sync_wait(release.render_fence.get(), timeout_ms);
+    if (ret && errno == ETIME && !wait && waited_ms < kRenderWaitTimeoutMs)
+      return;
+    if (ret)
+      ALOGE("Failed to wait for GL rendering %d", -errno);
+
+    Release(&release, !ret);
+    pending_releases_.pop_front();
+  }
+}
+
+void GLCompositorWorker::Release(PendingRelease *release, bool rendered) {
+  if (rendered) {
+    int64_t average = average_composite_time_ns_.load(std::memory_order_relaxed);
+    average += (GetTimeNs() - release->start_ns - average) >>
+               kCompositeTimeAverageShift;
+    average_composite_time_ns_.store(average, std::memory_order_relaxed);
+  }
+
+  // Release the source layers even if the GPU never finished so nothing waits
+  // on them forever
+  release->timeline->Signal(release->point);
+}
+
+void GLCompositorWorker::InitCompositor() {
+  // Runs at background priority unless WaitForInit raised it already. It
+  // checks the tid after setting init_boosted_, and the check below comes
+  // after publishing the tid, so one of the two always restores the priority.
+  init_tid_.store(gettid());
+  SetBackground(true);
+  if (init_boosted_.load())
+    SetBackground(false);
+
+  compositor_.reset(new GLWorkerCompositor());
+  init_ret_ = compositor_->Init();
+  if (init_ret_)
+    compositor_.reset();
+  else
+    ALOGI("GL compositor ready after %" PRId64 "ms",
+          (GetTimeNs() - init_start_ns_) / (1000 * 1000));
+
+  SetBackground(false);
+  init_done_.store(true);
+}
+
+void GLCompositorWorker::RunJob(Job *job) {
+  switch (job->type) {
+    case JobType::kInit:
+      InitCompositor();
+      break;
+    case JobType::kComposite:
+      CompositeJob(job);
+      break;
+    case JobType::kReleaseFramebuffers:
+      if (compositor_)
+        compositor_->ClearFramebufferCache();
+      break;
+    case JobType::kDestroy:
+      ReleaseRendered(true);
+      compositor_.reset();
+      break;
+  }
+}
+}
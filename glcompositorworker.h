@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_GL_COMPOSITOR_WORKER_H_
+#define ANDROID_GL_COMPOSITOR_WORKER_H_
+
+#include "autofd.h"
+#include "drmhwcomposer.h"
+#include "worker.h"
+
+#include <pthread.h>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+
+#include <ui/GraphicBuffer.h>
+
+namespace android {
+
+class AutoLock;
+class DrmDisplayComposition;
+class GLWorkerCompositor;
+class SyncTimeline;
+
+// Runs a GLWorkerCompositor on a dedicated thread which keeps its EGL context
+// current, so the thread submitting frames never waits for GL.
+class GLCompositorWorker : public Worker {
+ public:
+  GLCompositorWorker();
+  ~GLCompositorWorker() override;
+
+  // Starts initializing the GL compositor on the worker thread at background
+  // priority. Jobs queued before it's done run once it is.
+  int InitAsync();
+  // Blocks until initialization has completed and returns its result. The
+  // worker is raised to its regular priority while waiting.
+  int WaitForInit();
+  int Init();
+
+  // Composites the squash or precomp regions of composition into framebuffer,
+  // which covers the frame area of the display at scale times its resolution.
+  // Rendering waits for framebuffer_fence, if any, on the GPU so the display
+  // can still be reading framebuffer. Returns once the worker has submitted
+  // the rendering, with out_fence set to the native fence the GPU signals when
+  // it's done, for the plane to wait on. The source layers are released once
+  // it signals. Failing to composite fails the call, so framebuffer is never
+  // scanned out without having been rendered.
+  int Composite(DrmDisplayComposition *composition, bool squash,
+                const sp<GraphicBuffer> &framebuffer,
+                UniqueFd framebuffer_fence, const DrmHwcRect<int> &frame,
+                float scale, UniqueFd *out_fence);
+
+  // Queues dropping the GL resources cached for framebuffers, which keep
+  // their memory alive
+  int QueueReleaseFramebuffers();
+
+  // Blocks until everything queued so far has been rendered
+  void Finish();
+
+  // Moving average of how long composite jobs take from the start of
+  // rendering until the GPU is done, in nanoseconds
+  int64_t average_composite_time_ns() const {
+    return average_composite_time_ns_.load(std::memory_order_relaxed);
+  }
+
+ protected:
+  void Routine() override;
+
+ private:
+  enum class JobType {
+    kInit,
+    kComposite,
+    kReleaseFramebuffers,
+    kDestroy,
+  };
+
+  struct Job {
+    JobType type = JobType::kComposite;
+    DrmDisplayComposition *composition = NULL;
+    bool squash = false;
+    sp<GraphicBuffer> framebuffer;
+    UniqueFd framebuffer_fence;
+    DrmHwcRect<int> frame;
+    float scale = 1.0f;
+    // Composite jobs hand their result back to the thread waiting for them
+    int *ret = NULL;
+    UniqueFd *render_fence = NULL;
+  };
+
+  // Source layers of a composite job waiting for the GPU to finish with them
+  struct PendingRelease {
+    UniqueFd render_fence;
+    std::shared_ptr<SyncTimeline> timeline;
+    uint32_t point = 0;
+    // Kept alive until the GPU is done rendering into it
+    sp<GraphicBuffer> framebuffer;
+    int64_t start_ns = 0;
+  };
+
+  static const size_t kMaxQueueDepth = 4;
+  static const int kRenderWaitTimeoutMs = 1500;
+  // Weight of the newest sample in the composite time average, as a shift
+  static const int kCompositeTimeAverageShift = 3;
+
+  // Queues job, waiting while the queue is full, and if wait is set until the
+  // job has run
+  int QueueJob(Job &&job, bool wait);
+  void WakeLocked();
+  // Waits until a job is queued, the oldest pending release's fence signals
+  // or it has been pending for kRenderWaitTimeoutMs, with queue_lock_
+  // released meanwhile
+  void WaitLocked(AutoLock *lock);
+  void RunJob(Job *job);
+  void InitCompositor();
+  void CompositeJob(Job *job);
+  // Releases the source layers the GPU is done with, or all of them when
+  // wait is true
+  void ReleaseRendered(bool wait);
+  void Release(PendingRelease *release, bool rendered);
+
+  pthread_mutex_t queue_lock_;
+  // Broadcast whenever a job was taken from the queue or finished, and when
+  // pending releases were done
+  pthread_cond_t queue_cond_;
+  std::deque<Job> queue_;
+  uint64_t jobs_queued_;
+  uint64_t jobs_done_;
+  size_t releases_pending_;
+  bool exiting_;
+  // The thread waits for jobs and render fences at once with poll
+  UniqueFd wake_fd_;
+
+  // Only accessed from the worker thread, apart from init_ret_ which is read
+  // once init_done_ is set
+  std::unique_ptr<GLWorkerCompositor> compositor_;
+  std::deque<PendingRelease> pending_releases_;
+  int init_ret_;
+
+  int64_t init_start_ns_;
+  std::atomic<bool> init_done_;
+  std::atomic<bool> init_boosted_;
+  std::atomic<pid_t> init_tid_;
+
+  std::atomic<int64_t> average_composite_time_ns_;
+};
+}
+
+#endif
@@ -22,18 +22,28 @@
 #include <sstream>
 #include <unordered_set>
 
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <cutils/properties.h>
 
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
 
+#include <sync/sync.h>
+
 #include <ui/GraphicBuffer.h>
 #include <ui/PixelFormat.h>
 
 #include <utils/Trace.h>
 
+#include "autofd.h"
+#include "autolock.h"
 #include "drmdisplaycomposition.h"
 #include "platform.h"
 
@@ -41,6 +51,21 @@
 
 #define MAX_OVERLAPPING_LAYERS 64
 
+#define DEFAULT_TEXTURE_CACHE_MAX_COUNT 32
+#define DEFAULT_TEXTURE_CACHE_MAX_MB 128
+
+#define DEFAULT_VARIANT_CACHE_MAX_COUNT 16
+
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+// The HWC can't write system data, the device has to provide this directory
+// labelled for it
+#define DEFAULT_PROGRAM_CACHE_PATH "/data/vendor/hwc/hwc_gl_programs.bin"
+#define PROGRAM_CACHE_MAGIC 0x50434748 /* HGCP */
+#define PROGRAM_CACHE_VERSION 1
+
 namespace android {
 
 // clang-format off
@@ -143,71 +168,6 @@ static bool HasExtension(const char *extension, const char *extensions) {
   return false;
 }
 
-int GLWorkerCompositor::BeginContext() {
-  private_.saved_egl_display = eglGetCurrentDisplay();
-  private_.saved_egl_ctx = eglGetCurrentContext();
-
-  if (private_.saved_egl_display != egl_display_ ||
-      private_.saved_egl_ctx != egl_ctx_) {
-    private_.saved_egl_read = eglGetCurrentSurface(EGL_READ);
-    private_.saved_egl_draw = eglGetCurrentSurface(EGL_DRAW);
-  } else {
-    return 0;
-  }
-
-  if (!eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_ctx_)) {
-    ALOGE("BeginContext failed: %s", GetEGLError());
-    return 1;
-  }
-  return 0;
-}
-
-int GLWorkerCompositor::EndContext() {
-  if (private_.saved_egl_display != eglGetCurrentDisplay() ||
-      private_.saved_egl_ctx != eglGetCurrentContext()) {
-    if (!eglMakeCurrent(private_.saved_egl_display, private_.saved_egl_read,
-                        private_.saved_egl_draw, private_.saved_egl_ctx)) {
-      ALOGE("EndContext failed: %s", GetEGLError());
-      return 1;
-    }
-  }
-
-  return 0;
-}
-
-static AutoGLShader CompileAndCheckShader(GLenum type, unsigned source_count,
-                                          const GLchar **sources,
-                                          std::ostringstream *shader_log) {
-  GLint status;
-  AutoGLShader shader(glCreateShader(type));
-  if (shader.get() == 0) {
-    if (shader_log)
-      *shader_log << "Failed glCreateShader call";
-    return 0;
-  }
-
-  glShaderSource(shader.get(), source_count, sources, NULL);
-  glCompileShader(shader.get());
-  glGetShaderiv(shader.get(), GL_COMPILE_STATUS, &status);
-  if (!status) {
-    if (shader_log) {
-      GLint log_length;
-      glGetShaderiv(shader.get(), GL_INFO_LOG_LENGTH, &log_length);
-      std::string info_log(log_length, ' ');
-      glGetShaderInfoLog(shader.get(), log_length, NULL, &info_log.front());
-      *shader_log << "Failed to compile shader:\n" << info_log.c_str()
-                  << "\nShader Source:\n";
-      for (unsigned i = 0; i < source_count; i++) {
-        *shader_log << sources[i];
-      }
-      *shader_log << "\n";
-    }
-    return 0;
-  }
-
-  return shader;
-}
-
 static std::string GenerateVertexShader(int layer_count) {
   std::ostringstream vertex_shader_stream;
   vertex_shader_stream
@@ -233,6 +193,20 @@ static std::string GenerateVertexShader(int layer_count) {
   return vertex_shader_stream.str();
 }
 
+// Ordered dithering for targets with fewer bits per channel than the sources.
+// uDitherScale is the size of one step of the target in each channel, or zero
+// to leave the color untouched.
+static const char *kDitherShaderSource =
+    "uniform vec3 uDitherScale;\n"
+    "const float kBayer[16] = float[16](\n"
+    "    0.0, 8.0, 2.0, 10.0, 12.0, 4.0, 14.0, 6.0,\n"
+    "    3.0, 11.0, 1.0, 9.0, 15.0, 7.0, 13.0, 5.0);\n"
+    "vec3 dither(vec3 color) {\n"
+    "  ivec2 pos = ivec2(gl_FragCoord.xy) & 3;\n"
+    "  float threshold = (kBayer[pos.y * 4 + pos.x] + 0.5) / 16.0 - 0.5;\n"
+    "  return color + threshold * uDitherScale;\n"
+    "}\n";
+
 static std::string GenerateFragmentShader(int layer_count) {
   std::ostringstream fragment_shader_stream;
   fragment_shader_stream << "#version 300 es\n"
@@ -245,6 +219,7 @@ static std::string GenerateFragmentShader(int layer_count) {
   }
   fragment_shader_stream << "uniform float uLayerAlpha[LAYER_COUNT];\n"
                          << "uniform float uLayerPremult[LAYER_COUNT];\n"
+                         << kDitherShaderSource
                          << "in vec2 fTexCoords[LAYER_COUNT];\n"
                          << "out vec4 oFragColor;\n"
                          << "void main() {\n"
@@ -267,57 +242,194 @@ static std::string GenerateFragmentShader(int layer_count) {
   }
   for (int i = 0; i < layer_count - 1; ++i)
     fragment_shader_stream << "  }\n";
-  fragment_shader_stream << "  oFragColor = vec4(color, 1.0 - alphaCover);\n"
-                         << "}\n";
+  fragment_shader_stream
+      << "  oFragColor = vec4(dither(color), 1.0 - alphaCover);\n"
+      << "}\n";
   return fragment_shader_stream.str();
 }
 
-static AutoGLProgram GenerateProgram(unsigned num_textures,
-                                     std::ostringstream *shader_log) {
-  std::string vertex_shader_string = GenerateVertexShader(num_textures);
-  const GLchar *vertex_shader_source = vertex_shader_string.c_str();
-  AutoGLShader vertex_shader = CompileAndCheckShader(
-      GL_VERTEX_SHADER, 1, &vertex_shader_source, shader_log);
-  if (!vertex_shader.get())
-    return 0;
+// Each character of a variant string describes one source layer of a region,
+// top to bottom, as a combination of these flags offset from 'A' to keep the
+// string printable.
+enum VariantFlags {
+  kVariantOpaque = 1 << 0,
+  kVariantPremult = 1 << 1,
+  kVariantSwapXY = 1 << 2,
+  kVariantAlphaOne = 1 << 3,
+};
+
+static std::string GenerateVariantVertexShader(const std::string &variant) {
+  std::ostringstream vertex_shader_stream;
+  vertex_shader_stream << "#version 300 es\n"
+                       << "#define LAYER_COUNT " << variant.size() << "\n"
+                       << "precision mediump int;\n"
+                       << "uniform vec4 uViewport;\n"
+                       << "uniform vec4 uLayerCrop[LAYER_COUNT];\n"
+                       << "in vec2 vPosition;\n"
+                       << "in vec2 vTexCoords;\n"
+                       << "out vec2 fTexCoords[LAYER_COUNT];\n"
+                       << "void main() {\n";
+  for (size_t i = 0; i < variant.size(); ++i) {
+    unsigned flags = variant[i] - 'A';
+    const char *coords =
+        (flags & kVariantSwapXY) ? "vTexCoords.yx" : "vTexCoords";
+    vertex_shader_stream << "  fTexCoords[" << i << "] = uLayerCrop[" << i
+                         << "].xy + " << coords << " * uLayerCrop[" << i
+                         << "].zw;\n";
+  }
+  vertex_shader_stream
+      << "  vec2 scaledPosition = uViewport.xy + vPosition * uViewport.zw;\n"
+      << "  gl_Position =\n"
+      << "      vec4(scaledPosition * vec2(2.0) - vec2(1.0), 0.0, 1.0);\n"
+      << "}\n";
+  return vertex_shader_stream.str();
+}
+
+// Same blending as GenerateFragmentShader, with everything known up front
+// folded away: the premultiply select, multiplications by a plane alpha of
+// 1.0 and the coverage update below an opaque layer.
+static std::string GenerateVariantFragmentShader(const std::string &variant) {
+  std::ostringstream fragment_shader_stream;
+  fragment_shader_stream << "#version 300 es\n"
+                         << "#define LAYER_COUNT " << variant.size() << "\n"
+                         << "#extension GL_OES_EGL_image_external : require\n"
+                         << "precision mediump float;\n";
+  for (size_t i = 0; i < variant.size(); ++i) {
+    fragment_shader_stream << "uniform samplerExternalOES uLayerTexture" << i
+                           << ";\n";
+  }
+  fragment_shader_stream << "uniform float uLayerAlpha[LAYER_COUNT];\n"
+                         << kDitherShaderSource
+                         << "in vec2 fTexCoords[LAYER_COUNT];\n"
+                         << "out vec4 oFragColor;\n"
+                         << "void main() {\n"
+                         << "  vec3 color = vec3(0.0, 0.0, 0.0);\n"
+                         << "  float alphaCover = 1.0;\n"
+                         << "  vec4 texSample;\n";
+  for (size_t i = 0; i < variant.size(); ++i) {
+    unsigned flags = variant[i] - 'A';
+    if (i > 0)
+      fragment_shader_stream << "  if (alphaCover > 0.5/255.0) {\n";
+    fragment_shader_stream << "  texSample = texture2D(uLayerTexture" << i
+                           << ", fTexCoords[" << i << "]);\n";
+    if (flags & kVariantOpaque) {
+      fragment_shader_stream << "  color += texSample.rgb * alphaCover;\n"
+                             << "  alphaCover = 0.0;\n";
+    } else {
+      std::ostringstream alpha;
+      if (!(flags & kVariantAlphaOne))
+        alpha << " * uLayerAlpha[" << i << "]";
+      const char *premult = (flags & kVariantPremult) ? "" : " * texSample.a";
+      fragment_shader_stream << "  color += texSample.rgb" << premult
+                             << alpha.str() << " * alphaCover;\n"
+                             << "  alphaCover *= 1.0 - texSample.a"
+                             << alpha.str() << ";\n";
+    }
+  }
+  for (size_t i = 1; i < variant.size(); ++i)
+    fragment_shader_stream << "  }\n";
+  fragment_shader_stream
+      << "  oFragColor = vec4(dither(color), 1.0 - alphaCover);\n"
+      << "}\n";
+  return fragment_shader_stream.str();
+}
 
-  std::string fragment_shader_string = GenerateFragmentShader(num_textures);
-  const GLchar *fragment_shader_source = fragment_shader_string.c_str();
-  AutoGLShader fragment_shader = CompileAndCheckShader(
-      GL_FRAGMENT_SHADER, 1, &fragment_shader_source, shader_log);
-  if (!fragment_shader.get())
+// Shaders are compiled and programs linked without querying their status
+// until FinishProgramBuild. Issuing everything up front lets drivers that
+// implement KHR_parallel_shader_compile build several programs concurrently.
+
+static AutoGLShader StartShaderCompile(GLenum type, const std::string &source) {
+  AutoGLShader shader(glCreateShader(type));
+  if (shader.get() == 0)
     return 0;
 
-  AutoGLProgram program(glCreateProgram());
-  if (!program.get()) {
+  const GLchar *shader_source = source.c_str();
+  glShaderSource(shader.get(), 1, &shader_source, NULL);
+  glCompileShader(shader.get());
+  return shader;
+}
+
+static void LogShaderFailure(GLint shader, const std::string &source,
+                             std::ostringstream *shader_log) {
+  GLint status;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+  if (status)
+    return;
+
+  GLint log_length;
+  glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_length);
+  std::string info_log(log_length, ' ');
+  glGetShaderInfoLog(shader, log_length, NULL, &info_log.front());
+  *shader_log << "Failed to compile shader:\n" << info_log.c_str()
+              << "\nShader Source:\n" << source << "\n";
+}
+
+static int StartProgramBuild(const std::string &vertex_shader_source,
+                             const std::string &fragment_shader_source,
+                             PendingGLProgram *pending) {
+  pending->vertex_shader =
+      StartShaderCompile(GL_VERTEX_SHADER, vertex_shader_source);
+  pending->fragment_shader =
+      StartShaderCompile(GL_FRAGMENT_SHADER, fragment_shader_source);
+  pending->program.reset(glCreateProgram());
+  if (!pending->vertex_shader.get() || !pending->fragment_shader.get() ||
+      !pending->program.get())
+    return -ENOMEM;
+
+  GLint program = pending->program.get();
+  glAttachShader(program, pending->vertex_shader.get());
+  glAttachShader(program, pending->fragment_shader.get());
+  glBindAttribLocation(program, 0, "vPosition");
+  glBindAttribLocation(program, 1, "vTexCoords");
+  glLinkProgram(program);
+  return 0;
+}
+
+static AutoGLProgram FinishProgramBuild(
+    const std::string &vertex_shader_source,
+    const std::string &fragment_shader_source, PendingGLProgram *pending,
+    std::ostringstream *shader_log) {
+  if (!pending->program.get()) {
     if (shader_log)
       *shader_log << "Failed to create program: " << GetGLError() << "\n";
     return 0;
   }
 
-  glAttachShader(program.get(), vertex_shader.get());
-  glAttachShader(program.get(), fragment_shader.get());
-  glBindAttribLocation(program.get(), 0, "vPosition");
-  glBindAttribLocation(program.get(), 1, "vTexCoords");
-  glLinkProgram(program.get());
-  glDetachShader(program.get(), vertex_shader.get());
-  glDetachShader(program.get(), fragment_shader.get());
-
+  GLint program = pending->program.get();
   GLint status;
-  glGetProgramiv(program.get(), GL_LINK_STATUS, &status);
-  if (!status) {
-    if (shader_log) {
-      GLint log_length;
-      glGetProgramiv(program.get(), GL_INFO_LOG_LENGTH, &log_length);
-      std::string program_log(log_length, ' ');
-      glGetProgramInfoLog(program.get(), log_length, NULL,
-                          &program_log.front());
-      *shader_log << "Failed to link program:\n" << program_log.c_str() << "\n";
-    }
-    return 0;
+  glGetProgramiv(program, GL_LINK_STATUS, &status);
+  if (!status && shader_log) {
+    LogShaderFailure(pending->vertex_shader.get(), vertex_shader_source,
+                     shader_log);
+    LogShaderFailure(pending->fragment_shader.get(), fragment_shader_source,
+                     shader_log);
+
+    GLint log_length;
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_length);
+    std::string program_log(log_length, ' ');
+    glGetProgramInfoLog(program, log_length, NULL, &program_log.front());
+    *shader_log << "Failed to link program:\n" << program_log.c_str() << "\n";
   }
 
-  return program;
+  glDetachShader(program, pending->vertex_shader.get());
+  glDetachShader(program, pending->fragment_shader.get());
+  pending->vertex_shader.reset();
+  pending->fragment_shader.reset();
+
+  if (!status)
+    return 0;
+  return std::move(pending->program);
+}
+
+// FNV-1a, used to key program binaries. It needs to be stable across boots,
+// which std::hash doesn't guarantee.
+static uint64_t HashString(const std::string &str,
+                           uint64_t hash = 0xcbf29ce484222325ULL) {
+  for (unsigned char c : str) {
+    hash ^= c;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
 }
 
 struct RenderingCommand {
@@ -327,11 +439,11 @@ struct RenderingCommand {
     float alpha;
     float premult;
     float texture_matrix[4];
+    unsigned variant_flags;
   };
 
   float bounds[4];
-  unsigned texture_count = 0;
-  TextureSource textures[MAX_OVERLAPPING_LAYERS];
+  std::vector<TextureSource> textures;
 };
 
 static void ConstructCommand(const DrmHwcLayer *layers,
@@ -356,8 +468,8 @@ static void ConstructCommand(const DrmHwcLayer *layers,
     float crop_size[2] = {crop_rect.bounds[2] - crop_rect.bounds[0],
                           crop_rect.bounds[3] - crop_rect.bounds[1]};
 
-    RenderingCommand::TextureSource &src = cmd.textures[cmd.texture_count];
-    cmd.texture_count++;
+    cmd.textures.emplace_back();
+    RenderingCommand::TextureSource &src = cmd.textures.back();
     src.texture_index = texture_index;
 
     bool swap_xy = false;
@@ -408,17 +520,31 @@ static void ConstructCommand(const DrmHwcLayer *layers,
       }
     }
 
+    src.variant_flags = swap_xy ? kVariantSwapXY : 0;
+
     if (layer.blending == DrmHwcBlending::kNone) {
       src.alpha = src.premult = 1.0f;
+      src.variant_flags |= kVariantOpaque;
       // This layer is opaque. There is no point in using layers below this one.
       break;
     }
 
     src.alpha = layer.alpha / 255.0f;
     src.premult = (layer.blending == DrmHwcBlending::kPreMult) ? 1.0f : 0.0f;
+    if (layer.alpha == 0xff)
+      src.variant_flags |= kVariantAlphaOne;
+    if (layer.blending == DrmHwcBlending::kPreMult)
+      src.variant_flags |= kVariantPremult;
   }
 }
 
+static std::string GetVariant(const RenderingCommand &cmd) {
+  std::string variant(cmd.textures.size(), 'A');
+  for (unsigned i = 0; i < cmd.textures.size(); i++)
+    variant[i] += cmd.textures[i].variant_flags;
+  return variant;
+}
+
 static int EGLFenceWait(EGLDisplay egl_display, int acquireFenceFd) {
   int ret = 0;
 
@@ -442,6 +568,26 @@ static int EGLFenceWait(EGLDisplay egl_display, int acquireFenceFd) {
   return ret;
 }
 
+// Flushes the commands issued so far and returns a native fence that signals
+// once the GPU has executed them, or -1 on failure
+static int CreateNativeFence(EGLDisplay egl_display) {
+  EGLSyncKHR egl_sync =
+      eglCreateSyncKHR(egl_display, EGL_SYNC_NATIVE_FENCE_ANDROID, NULL);
+  if (egl_sync == EGL_NO_SYNC_KHR) {
+    ALOGE("Failed to create native fence sync: %s", GetEGLError());
+    return -1;
+  }
+
+  // The fence fd only exists once the sync has been flushed
+  glFlush();
+  int fence = eglDupNativeFenceFDANDROID(egl_display, egl_sync);
+  if (fence == EGL_NO_NATIVE_FENCE_FD_ANDROID)
+    ALOGE("Failed to duplicate native fence fd: %s", GetEGLError());
+  eglDestroySyncKHR(egl_display, egl_sync);
+
+  return fence;
+}
+
 static int CreateTextureFromHandle(EGLDisplay egl_display,
                                    buffer_handle_t handle,
 				   DrmHwcBuffer *buffer,
@@ -541,9 +687,12 @@ int GLWorkerCompositor::Init() {
     return 1;
   }
 
-  ret = BeginContext();
-  if (ret)
-    return ret;
+  // The context stays current on the calling thread for the lifetime of the
+  // compositor, which avoids switching contexts around every frame
+  if (!eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_ctx_)) {
+    ALOGE("Failed to make OpenGL ES Context current: %s", GetEGLError());
+    return 1;
+  }
 
   gl_extensions = (const char *)glGetString(GL_EXTENSIONS);
 
@@ -560,12 +709,37 @@ int GLWorkerCompositor::Init() {
   glBindBuffer(GL_ARRAY_BUFFER, 0);
   vertex_buffer_.reset(vertex_buffer);
 
-  std::ostringstream shader_log;
-  blend_programs_.emplace_back(GenerateProgram(1, &shader_log));
+  char variant_cache_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.shader_variant_cache_size", variant_cache_opt, "");
+  variant_cache_max_count_ = variant_cache_opt[0]
+                                 ? atoi(variant_cache_opt)
+                                 : DEFAULT_VARIANT_CACHE_MAX_COUNT;
+
+  LoadProgramCache();
 
-  EndContext();
+  std::ostringstream shader_log;
+  ret = BuildBlendPrograms(&shader_log);
+
+  if (program_cache_dirty_)
+    SaveProgramCache();
+
+  char use_texture_cache_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.use_texture_cache", use_texture_cache_opt, "1");
+  if (atoi(use_texture_cache_opt)) {
+    char max_count_opt[PROPERTY_VALUE_MAX];
+    property_get("hwc.drm.texture_cache_max_count", max_count_opt, "");
+    int max_count = atoi(max_count_opt);
+    texture_cache_max_count_ =
+        max_count > 0 ? max_count : DEFAULT_TEXTURE_CACHE_MAX_COUNT;
+
+    char max_mb_opt[PROPERTY_VALUE_MAX];
+    property_get("hwc.drm.texture_cache_max_mb", max_mb_opt, "");
+    int max_mb = atoi(max_mb_opt);
+    texture_cache_max_bytes_ =
+        (size_t)(max_mb > 0 ? max_mb : DEFAULT_TEXTURE_CACHE_MAX_MB) << 20;
+  }
 
-  if (blend_programs_.back().get() == 0) {
+  if (ret) {
     ALOGE("%s", shader_log.str().c_str());
     return 1;
   }
@@ -574,79 +748,167 @@ int GLWorkerCompositor::Init() {
 }
 
 GLWorkerCompositor::~GLWorkerCompositor() {
-  if (egl_display_ != EGL_NO_DISPLAY && egl_ctx_ != EGL_NO_CONTEXT)
+  // Release GL objects while the context is still current
+  ClearTextureCache();
+  SetTextureCacheImporter(NULL);
+  cached_framebuffers_.clear();
+  variant_programs_.clear();
+  blend_programs_.clear();
+  vertex_buffer_.reset();
+
+  if (egl_display_ != EGL_NO_DISPLAY && egl_ctx_ != EGL_NO_CONTEXT) {
+    eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                   EGL_NO_CONTEXT);
     if (eglDestroyContext(egl_display_, egl_ctx_) == EGL_FALSE)
       ALOGE("Failed to destroy OpenGL ES Context: %s", GetEGLError());
+  }
 }
 
 int GLWorkerCompositor::Composite(DrmHwcLayer *layers,
                                   DrmCompositionRegion *regions,
                                   size_t num_regions,
                                   const sp<GraphicBuffer> &framebuffer,
-                                  Importer *importer) {
+                                  UniqueFd framebuffer_fence,
+                                  const DrmHwcRect<int> &frame, float scale,
+                                  Importer *importer, UniqueFd *out_fence) {
   ATRACE_CALL();
   int ret = 0;
-  std::vector<AutoEGLImageAndGLTexture> layer_textures;
+  std::vector<AutoEGLImageAndGLTexture> uncached_textures;
   std::vector<RenderingCommand> commands;
 
   if (num_regions == 0) {
     return -EALREADY;
   }
 
-  ret = BeginContext();
-  if (ret)
-    return -1;
-
-  GLint frame_width = framebuffer->getWidth();
-  GLint frame_height = framebuffer->getHeight();
+  GLint frame_width = lroundf(frame.width() * scale);
+  GLint frame_height = lroundf(frame.height() * scale);
   CachedFramebuffer *cached_framebuffer =
       PrepareAndCacheFramebuffer(framebuffer);
   if (cached_framebuffer == NULL) {
     ALOGE("Composite failed because of failed framebuffer");
-    EndContext();
     return -EINVAL;
   }
 
+  // The display may still be scanning out the framebuffer. The GPU waits for
+  // it to be released, unless the fence can't be handed to EGL.
+  if (framebuffer_fence.get() >= 0) {
+    int fd = dup(framebuffer_fence.get());
+    if (fd < 0 || EGLFenceWait(egl_display_, fd)) {
+      ret = sync_wait(framebuffer_fence.get(), -1);
+      if (ret) {
+        ALOGE("Failed to wait for framebuffer release %d", ret);
+        return ret;
+      }
+    }
+  }
+
+  SetTextureCacheImporter(importer);
+  ReleaseFreedTextures();
+  texture_cache_serial_++;
+
   std::unordered_set<size_t> layers_used_indices;
   for (size_t region_index = 0; region_index < num_regions; region_index++) {
     DrmCompositionRegion &region = regions[region_index];
     layers_used_indices.insert(region.source_layers.begin(),
                                region.source_layers.end());
     commands.emplace_back();
-    ConstructCommand(layers, region, commands.back());
+    RenderingCommand &cmd = commands.back();
+    ConstructCommand(layers, region, cmd);
+
+    // Layers are positioned on the display, but the framebuffer only covers
+    // frame. Scaled edges are rounded to whole pixels so neighbouring regions
+    // still meet without gaps or overlap.
+    for (int i = 0; i < 4; i++) {
+      int origin = (i % 2) ? frame.top : frame.left;
+      cmd.bounds[i] = roundf((cmd.bounds[i] - origin) * scale);
+    }
   }
 
-  for (size_t layer_index = 0; layer_index < MAX_OVERLAPPING_LAYERS;
-       layer_index++) {
-    DrmHwcLayer *layer = &layers[layer_index];
+  // Regions may reference any layer of the composition, not just the first
+  // few, so the table covers every index they use.
+  size_t num_layers = 0;
+  for (size_t layer_index : layers_used_indices)
+    num_layers = std::max(num_layers, layer_index + 1);
+  std::vector<GLuint> layer_textures(num_layers, 0);
 
-    layer_textures.emplace_back();
+  for (size_t layer_index = 0; layer_index < num_layers; layer_index++) {
+    DrmHwcLayer *layer = &layers[layer_index];
 
     if (layers_used_indices.count(layer_index) == 0)
       continue;
 
-    ret = CreateTextureFromHandle(egl_display_, layer->get_usable_handle(),
-                                  &layer->buffer, importer,
-				  &layer_textures.back());
+    GLuint texture = 0;
+    if (texture_cache_max_count_ > 0) {
+      texture = PrepareAndCacheTexture(layer, importer);
+      if (texture == 0)
+        ret = -EINVAL;
+    } else {
+      uncached_textures.emplace_back();
+      ret = CreateTextureFromHandle(egl_display_, layer->get_usable_handle(),
+                                    &layer->buffer, importer,
+                                    &uncached_textures.back());
+      texture = uncached_textures.back().texture.get();
+    }
 
     if (!ret) {
       ret = EGLFenceWait(egl_display_, layer->acquire_fence.Release());
     }
     if (ret) {
-      layer_textures.pop_back();
       ret = -EINVAL;
+      break;
     }
+    layer_textures[layer_index] = texture;
   }
 
   if (ret) {
-    EndContext();
+    TrimTextureCache();
     return ret;
   }
 
-  glViewport(0, 0, frame_width, frame_height);
+  // Regions are disjoint, so their areas add up to the area of their union.
+  // When that covers all of frame the previous contents of the framebuffer
+  // are invalidated rather than cleared, which saves tiled GPUs both loading
+  // and clearing every tile.
+  GLint viewport[4] = {frame_width, frame_height, 0, 0};
+  int64_t covered_area = 0;
+  for (const RenderingCommand &cmd : commands) {
+    int left = std::max((int)cmd.bounds[0], 0);
+    int top = std::max((int)cmd.bounds[1], 0);
+    int right = std::min((int)cmd.bounds[2], frame_width);
+    int bottom = std::min((int)cmd.bounds[3], frame_height);
+    if (left >= right || top >= bottom)
+      continue;
+
+    covered_area += (int64_t)(right - left) * (bottom - top);
+    viewport[0] = std::min(viewport[0], left);
+    viewport[1] = std::min(viewport[1], top);
+    viewport[2] = std::max(viewport[2], right);
+    viewport[3] = std::max(viewport[3], bottom);
+  }
+
+  static const float kNoDither[3] = {0.0f, 0.0f, 0.0f};
+  static const float kDither565[3] = {1.0f / 31.0f, 1.0f / 63.0f,
+                                      1.0f / 31.0f};
+  const float *dither_scale =
+      framebuffer->getPixelFormat() == PIXEL_FORMAT_RGB_565 ? kDither565
+                                                            : kNoDither;
 
-  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
-  glClear(GL_COLOR_BUFFER_BIT);
+  if (covered_area >= (int64_t)frame_width * frame_height) {
+    const GLenum attachments[] = {GL_COLOR_ATTACHMENT0};
+    glInvalidateFramebuffer(GL_FRAMEBUFFER, 1, attachments);
+  } else {
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+  }
+
+  // Only the union of the regions is rasterized
+  if (covered_area > 0) {
+    viewport[2] -= viewport[0];
+    viewport[3] -= viewport[1];
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+  } else {
+    commands.clear();
+  }
 
   glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer_.get());
   glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 4, NULL);
@@ -657,57 +919,48 @@ int GLWorkerCompositor::Composite(DrmHwcLayer *layers,
   glEnable(GL_SCISSOR_TEST);
 
   for (const RenderingCommand &cmd : commands) {
-    if (cmd.texture_count == 0)
+    if (cmd.textures.empty())
       continue;
 
-    // TODO(zachr): handle the case of too many overlapping textures for one
-    // area by falling back to rendering as many layers as possible using
-    // multiple blending passes.
-    GLint program = PrepareAndCacheProgram(cmd.texture_count);
-    if (program == 0) {
-      ALOGE("Too many layers to render in one area");
+    // Regions overlapping more layers than the largest program can sample are
+    // drawn in several passes, bottom-most layers first, each blended over the
+    // result of the previous ones. Every layer is fetched exactly once either
+    // way, so the fewest passes of roughly equal size are the cheapest.
+    unsigned max_layers = blend_programs_.size();
+    unsigned texture_count = cmd.textures.size();
+    unsigned pass_count = (texture_count + max_layers - 1) / max_layers;
+    if (pass_count == 1) {
+      ret = DrawCommand(cmd, layer_textures.data(), viewport, dither_scale);
+      if (ret)
+        break;
       continue;
     }
 
-    glUseProgram(program);
-    GLint gl_viewport_loc = glGetUniformLocation(program, "uViewport");
-    GLint gl_crop_loc = glGetUniformLocation(program, "uLayerCrop");
-    GLint gl_alpha_loc = glGetUniformLocation(program, "uLayerAlpha");
-    GLint gl_premult_loc = glGetUniformLocation(program, "uLayerPremult");
-    GLint gl_tex_matrix_loc = glGetUniformLocation(program, "uTexMatrix");
-    glUniform4f(gl_viewport_loc, cmd.bounds[0] / (float)frame_width,
-                cmd.bounds[1] / (float)frame_height,
-                (cmd.bounds[2] - cmd.bounds[0]) / (float)frame_width,
-                (cmd.bounds[3] - cmd.bounds[1]) / (float)frame_height);
-
-    for (unsigned src_index = 0; src_index < cmd.texture_count; src_index++) {
-      std::ostringstream texture_name_formatter;
-      texture_name_formatter << "uLayerTexture" << src_index;
-      GLint gl_tex_loc =
-          glGetUniformLocation(program, texture_name_formatter.str().c_str());
-
-      const RenderingCommand::TextureSource &src = cmd.textures[src_index];
-      glUniform1f(gl_alpha_loc + src_index, src.alpha);
-      glUniform1f(gl_premult_loc + src_index, src.premult);
-      glUniform4f(gl_crop_loc + src_index, src.crop_bounds[0],
-                  src.crop_bounds[1], src.crop_bounds[2] - src.crop_bounds[0],
-                  src.crop_bounds[3] - src.crop_bounds[1]);
-      glUniform1i(gl_tex_loc, src_index);
-      glUniformMatrix2fv(gl_tex_matrix_loc + src_index, 1, GL_FALSE,
-                         src.texture_matrix);
-      glActiveTexture(GL_TEXTURE0 + src_index);
-      glBindTexture(GL_TEXTURE_EXTERNAL_OES,
-                    layer_textures[src.texture_index].texture.get());
-    }
+    for (unsigned pass = pass_count; pass-- > 0;) {
+      unsigned begin = texture_count * pass / pass_count;
+      unsigned end = texture_count * (pass + 1) / pass_count;
 
-    glScissor(cmd.bounds[0], cmd.bounds[1], cmd.bounds[2] - cmd.bounds[0],
-              cmd.bounds[3] - cmd.bounds[1]);
-    glDrawArrays(GL_TRIANGLES, 0, 3);
+      RenderingCommand pass_cmd;
+      std::copy_n(cmd.bounds, 4, pass_cmd.bounds);
+      pass_cmd.textures.assign(cmd.textures.begin() + begin,
+                               cmd.textures.begin() + end);
 
-    for (unsigned src_index = 0; src_index < cmd.texture_count; src_index++) {
-      glActiveTexture(GL_TEXTURE0 + src_index);
-      glBindTexture(GL_TEXTURE_EXTERNAL_OES, 0);
+      if (pass == pass_count - 1) {
+        glDisable(GL_BLEND);
+      } else {
+        // The programs output premultiplied color
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+      }
+      // Only the final color is dithered, which the top-most pass produces
+      ret = DrawCommand(pass_cmd, layer_textures.data(), viewport,
+                        pass == 0 ? dither_scale : kNoDither);
+      if (ret)
+        break;
     }
+    glDisable(GL_BLEND);
+    if (ret)
+      break;
   }
 
   glDisable(GL_SCISSOR_TEST);
@@ -719,13 +972,72 @@ int GLWorkerCompositor::Composite(DrmHwcLayer *layers,
 
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-  EndContext();
+  if (ret) {
+    // Passes already issued may still sample the layers
+    glFinish();
+    TrimTextureCache();
+    return ret;
+  }
+
+  // Rather than blocking until the GPU is done, hand out a fence the display
+  // hardware can wait on before scanning out the framebuffer.
+  int fence = CreateNativeFence(egl_display_);
+  if (fence < 0)
+    glFinish();
+  out_fence->Set(fence);
+
+  TrimTextureCache();
+
   return ret;
 }
 
+int GLWorkerCompositor::DrawCommand(const RenderingCommand &cmd,
+                                    const GLuint *layer_textures,
+                                    const GLint *viewport,
+                                    const float *dither_scale) {
+  const BlendProgram *program = PrepareAndCacheVariant(cmd);
+  if (program == NULL)
+    program = PrepareAndCacheProgram(cmd.textures.size());
+  if (program == NULL) {
+    ALOGE("Failed to get program for %zu layers", cmd.textures.size());
+    return -EINVAL;
+  }
+
+  glUseProgram(program->program.get());
+  glUniform4f(program->viewport_loc,
+              (cmd.bounds[0] - viewport[0]) / (float)viewport[2],
+              (cmd.bounds[1] - viewport[1]) / (float)viewport[3],
+              (cmd.bounds[2] - cmd.bounds[0]) / (float)viewport[2],
+              (cmd.bounds[3] - cmd.bounds[1]) / (float)viewport[3]);
+  glUniform3fv(program->dither_scale_loc, 1, dither_scale);
+
+  for (unsigned src_index = 0; src_index < cmd.textures.size(); src_index++) {
+    const RenderingCommand::TextureSource &src = cmd.textures[src_index];
+    glUniform1f(program->alpha_locs[src_index], src.alpha);
+    glUniform1f(program->premult_locs[src_index], src.premult);
+    glUniform4f(program->crop_locs[src_index], src.crop_bounds[0],
+                src.crop_bounds[1], src.crop_bounds[2] - src.crop_bounds[0],
+                src.crop_bounds[3] - src.crop_bounds[1]);
+    glUniform1i(program->texture_locs[src_index], src_index);
+    glUniformMatrix2fv(program->tex_matrix_locs[src_index], 1, GL_FALSE,
+                       src.texture_matrix);
+    glActiveTexture(GL_TEXTURE0 + src_index);
+    glBindTexture(GL_TEXTURE_EXTERNAL_OES, layer_textures[src.texture_index]);
+  }
+
+  glScissor(cmd.bounds[0], cmd.bounds[1], cmd.bounds[2] - cmd.bounds[0],
+            cmd.bounds[3] - cmd.bounds[1]);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+
+  for (unsigned src_index = 0; src_index < cmd.textures.size(); src_index++) {
+    glActiveTexture(GL_TEXTURE0 + src_index);
+    glBindTexture(GL_TEXTURE_EXTERNAL_OES, 0);
+  }
+  return 0;
+}
+
 void GLWorkerCompositor::Finish() {
   ATRACE_CALL();
-  glFinish();
 
   char use_framebuffer_cache_opt[PROPERTY_VALUE_MAX];
   property_get("hwc.drm.use_framebuffer_cache", use_framebuffer_cache_opt, "1");
@@ -739,6 +1051,10 @@ void GLWorkerCompositor::Finish() {
   }
 }
 
+void GLWorkerCompositor::ClearFramebufferCache() {
+  cached_framebuffers_.clear();
+}
+
 GLWorkerCompositor::CachedFramebuffer::CachedFramebuffer(
     const sp<GraphicBuffer> &gb, AutoEGLDisplayImage &&image,
     AutoGLTexture &&tex, AutoGLFramebuffer &&fb)
@@ -822,22 +1138,517 @@ GLWorkerCompositor::PrepareAndCacheFramebuffer(
   return &cached_framebuffers_.back();
 }
 
-GLint GLWorkerCompositor::PrepareAndCacheProgram(unsigned texture_count) {
-  if (blend_programs_.size() >= texture_count) {
-    GLint program = blend_programs_[texture_count - 1].get();
-    if (program != 0)
-      return program;
+void GLWorkerCompositor::BlendProgram::ResolveUniforms(unsigned layer_count) {
+  GLint prog = program.get();
+  viewport_loc = glGetUniformLocation(prog, "uViewport");
+  dither_scale_loc = glGetUniformLocation(prog, "uDitherScale");
+  crop_locs.resize(layer_count);
+  alpha_locs.resize(layer_count);
+  premult_locs.resize(layer_count);
+  tex_matrix_locs.resize(layer_count);
+  texture_locs.resize(layer_count);
+  for (unsigned i = 0; i < layer_count; i++) {
+    std::string index = "[" + std::to_string(i) + "]";
+    crop_locs[i] = glGetUniformLocation(prog, ("uLayerCrop" + index).c_str());
+    alpha_locs[i] = glGetUniformLocation(prog, ("uLayerAlpha" + index).c_str());
+    premult_locs[i] =
+        glGetUniformLocation(prog, ("uLayerPremult" + index).c_str());
+    tex_matrix_locs[i] =
+        glGetUniformLocation(prog, ("uTexMatrix" + index).c_str());
+    texture_locs[i] = glGetUniformLocation(
+        prog, ("uLayerTexture" + std::to_string(i)).c_str());
   }
+}
+
+const GLWorkerCompositor::BlendProgram *
+GLWorkerCompositor::PrepareAndCacheProgram(unsigned texture_count) {
+  // Every program the driver can handle was built by Init, so anything
+  // missing here would fail to link anyway.
+  if (texture_count == 0 || texture_count > blend_programs_.size())
+    return NULL;
+  return &blend_programs_[texture_count - 1];
+}
+
+const GLWorkerCompositor::BlendProgram *
+GLWorkerCompositor::PrepareAndCacheVariant(const RenderingCommand &cmd) {
+  if (variant_cache_max_count_ == 0 || cmd.textures.empty() ||
+      cmd.textures.size() > blend_programs_.size())
+    return NULL;
+
+  std::string variant = GetVariant(cmd);
+  variant_serial_++;
+
+  for (auto it = variant_programs_.begin(); it != variant_programs_.end();
+       ++it) {
+    if (it->variant != variant)
+      continue;
 
-  AutoGLProgram program = GenerateProgram(texture_count, NULL);
-  if (program.get() != 0) {
-    if (blend_programs_.size() < texture_count)
-      blend_programs_.resize(texture_count);
-    blend_programs_[texture_count - 1] = std::move(program);
-    return blend_programs_[texture_count - 1].get();
+    it->last_used = variant_serial_;
+    if (!it->program.get() && !FinishVariant(&*it, false))
+      return NULL;
+    return &*it;
   }
 
-  return 0;
+  if (variant_programs_.size() >= variant_cache_max_count_) {
+    auto lru = std::min_element(
+        variant_programs_.begin(), variant_programs_.end(),
+        [](const BlendProgram &a, const BlendProgram &b) {
+          return a.last_used < b.last_used;
+        });
+    variant_programs_.erase(lru);
+  }
+
+  variant_programs_.emplace_back();
+  BlendProgram &program = variant_programs_.back();
+  program.variant = variant;
+  program.last_used = variant_serial_;
+  std::string vertex_source = GenerateVariantVertexShader(variant);
+  std::string fragment_source = GenerateVariantFragmentShader(variant);
+  program.key = HashString(fragment_source, HashString(vertex_source));
+
+  // Binaries from an earlier boot link without compiling anything
+  program.program = LoadProgramBinary(program.key);
+  if (program.program.get()) {
+    program.ResolveUniforms(variant.size());
+    return &program;
+  }
+
+  // Compiling here would stall the frame, so without parallel compilation the
+  // variant is built once the worker is idle
+  if (!parallel_shader_compile_) {
+    program.deferred = true;
+    return NULL;
+  }
+
+  if (StartProgramBuild(vertex_source, fragment_source, &program.pending)) {
+    variant_programs_.pop_back();
+    return NULL;
+  }
+  if (!FinishVariant(&program, false))
+    return NULL;
+  return &program;
+}
+
+bool GLWorkerCompositor::BuildDeferredVariant() {
+  for (BlendProgram &program : variant_programs_) {
+    if (!program.deferred)
+      continue;
+
+    program.deferred = false;
+    if (!StartProgramBuild(GenerateVariantVertexShader(program.variant),
+                           GenerateVariantFragmentShader(program.variant),
+                           &program.pending))
+      FinishVariant(&program, true);
+    return true;
+  }
+
+  if (program_cache_dirty_)
+    SaveProgramCache();
+  return false;
+}
+
+bool GLWorkerCompositor::FinishVariant(BlendProgram *variant, bool wait) {
+  if (!variant->pending.program.get())
+    return false;
+
+  if (!wait) {
+    GLint done = GL_FALSE;
+    glGetProgramiv(variant->pending.program.get(), GL_COMPLETION_STATUS_KHR,
+                   &done);
+    if (!done)
+      return false;
+  }
+
+  variant->program = FinishProgramBuild(std::string(), std::string(),
+                                        &variant->pending, NULL);
+  if (!variant->program.get()) {
+    // Keep the entry around so we don't retry every frame
+    ALOGE("Failed to build blend program variant %s",
+          variant->variant.c_str());
+    variant->pending.program.reset();
+    return false;
+  }
+
+  variant->ResolveUniforms(variant->variant.size());
+  StoreProgramBinary(variant->key, variant->program.get());
+  return true;
+}
+
+int GLWorkerCompositor::BuildBlendPrograms(std::ostringstream *shader_log) {
+  ATRACE_CALL();
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Each layer needs its own sampler and texture coordinate varying, so the
+  // GL limits bound how many layers a single program can blend.
+  GLint max_texture_units = 0;
+  GLint max_varying_vectors = 0;
+  glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS, &max_texture_units);
+  glGetIntegerv(GL_MAX_VARYING_VECTORS, &max_varying_vectors);
+  unsigned max_layers = std::min<unsigned>(
+      MAX_OVERLAPPING_LAYERS,
+      std::min(max_texture_units, max_varying_vectors));
+  if (max_layers == 0)
+    max_layers = 1;
+
+  const char *gl_extensions = (const char *)glGetString(GL_EXTENSIONS);
+  if (HasExtension("GL_KHR_parallel_shader_compile", gl_extensions)) {
+    typedef void (*MaxShaderCompilerThreadsFunc)(GLuint count);
+    MaxShaderCompilerThreadsFunc max_shader_compiler_threads =
+        (MaxShaderCompilerThreadsFunc)eglGetProcAddress(
+            "glMaxShaderCompilerThreadsKHR");
+    if (max_shader_compiler_threads) {
+      max_shader_compiler_threads(0xffffffff);
+      parallel_shader_compile_ = true;
+    }
+  }
+
+  std::vector<std::string> vertex_sources(max_layers);
+  std::vector<std::string> fragment_sources(max_layers);
+  std::vector<uint64_t> keys(max_layers);
+  blend_programs_.clear();
+  blend_programs_.resize(max_layers);
+
+  unsigned num_cached = 0;
+  for (unsigned i = 0; i < max_layers; i++) {
+    vertex_sources[i] = GenerateVertexShader(i + 1);
+    fragment_sources[i] = GenerateFragmentShader(i + 1);
+    keys[i] = HashString(fragment_sources[i], HashString(vertex_sources[i]));
+
+    BlendProgram &program = blend_programs_[i];
+    program.program = LoadProgramBinary(keys[i]);
+    if (program.program.get()) {
+      num_cached++;
+      continue;
+    }
+
+    StartProgramBuild(vertex_sources[i], fragment_sources[i],
+                      &program.pending);
+  }
+
+  for (unsigned i = 0; i < max_layers; i++) {
+    BlendProgram &program = blend_programs_[i];
+    if (!program.program.get()) {
+      // Only a failure of the single layer program is fatal, larger ones
+      // are expected to fail on drivers with fewer resources than we assume.
+      program.program =
+          FinishProgramBuild(vertex_sources[i], fragment_sources[i],
+                             &program.pending, i == 0 ? shader_log : NULL);
+      if (!program.program.get()) {
+        ALOGW("Failed to build blend program for %u layers", i + 1);
+        blend_programs_.resize(i);
+        break;
+      }
+
+      StoreProgramBinary(keys[i], program.program.get());
+    }
+
+    program.ResolveUniforms(i + 1);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  int64_t elapsed_us = (end.tv_sec - start.tv_sec) * 1000000 +
+                       (end.tv_nsec - start.tv_nsec) / 1000;
+  ALOGI("Built %zu blend programs (%u from cache) in %" PRId64 "us",
+        blend_programs_.size(), num_cached, elapsed_us);
+
+  return blend_programs_.empty() ? -EINVAL : 0;
+}
+
+void GLWorkerCompositor::LoadProgramCache() {
+  const char *gl_extensions = (const char *)glGetString(GL_EXTENSIONS);
+  GLint num_binary_formats = 0;
+  if (HasExtension("GL_OES_get_program_binary", gl_extensions))
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &num_binary_formats);
+  if (num_binary_formats <= 0)
+    return;
+
+  char path[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.program_cache_path", path,
+               DEFAULT_PROGRAM_CACHE_PATH);
+  program_cache_path_ = path;
+  if (program_cache_path_.empty())
+    return;
+
+  // Binaries are only usable with the exact driver that produced them
+  std::ostringstream driver;
+  driver << PROGRAM_CACHE_VERSION << (const char *)glGetString(GL_VENDOR)
+         << (const char *)glGetString(GL_RENDERER)
+         << (const char *)glGetString(GL_VERSION);
+  program_cache_driver_hash_ = HashString(driver.str());
+
+  UniqueFd fd(open(program_cache_path_.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd.get() < 0) {
+    program_cache_dirty_ = true;
+    return;
+  }
+
+  struct stat cache_stat;
+  if (fstat(fd.get(), &cache_stat) || cache_stat.st_size <= 0) {
+    program_cache_dirty_ = true;
+    return;
+  }
+
+  std::vector<uint8_t> data(cache_stat.st_size);
+  if (read(fd.get(), data.data(), data.size()) != (ssize_t)data.size()) {
+    ALOGW("Failed to read program cache %s", program_cache_path_.c_str());
+    program_cache_dirty_ = true;
+    return;
+  }
+
+  size_t offset = 0;
+  auto read_field = [&](void *out, size_t size) {
+    if (data.size() - offset < size)
+      return false;
+    memcpy(out, data.data() + offset, size);
+    offset += size;
+    return true;
+  };
+
+  uint32_t magic, num_entries;
+  uint64_t driver_hash;
+  if (!read_field(&magic, sizeof(magic)) || magic != PROGRAM_CACHE_MAGIC ||
+      !read_field(&driver_hash, sizeof(driver_hash)) ||
+      driver_hash != program_cache_driver_hash_ ||
+      !read_field(&num_entries, sizeof(num_entries))) {
+    ALOGI("Discarding stale program cache %s", program_cache_path_.c_str());
+    program_cache_dirty_ = true;
+    return;
+  }
+
+  for (uint32_t i = 0; i < num_entries; i++) {
+    uint64_t key;
+    uint32_t format, size;
+    if (!read_field(&key, sizeof(key)) ||
+        !read_field(&format, sizeof(format)) ||
+        !read_field(&size, sizeof(size)) || data.size() - offset < size) {
+      ALOGW("Truncated program cache %s", program_cache_path_.c_str());
+      program_cache_dirty_ = true;
+      break;
+    }
+
+    ProgramBinary &binary = program_binaries_[key];
+    binary.format = format;
+    binary.data.assign(data.begin() + offset, data.begin() + offset + size);
+    offset += size;
+  }
+}
+
+void GLWorkerCompositor::SaveProgramCache() {
+  if (program_cache_path_.empty())
+    return;
+
+  // Saving fails the same way every time if the directory isn't writable, so
+  // that's only logged once
+  auto save_failed = [this](const char *what, const std::string &path) {
+    if (!program_cache_save_failed_)
+      ALOGW("Failed to %s program cache %s %d, programs will be compiled on "
+            "every boot",
+            what, path.c_str(), errno);
+    program_cache_save_failed_ = true;
+    // Retried once there's something new to save
+    program_cache_dirty_ = false;
+  };
+
+  std::string tmp_path = program_cache_path_ + ".tmp";
+  UniqueFd fd(open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   0600));
+  if (fd.get() < 0) {
+    save_failed("create", tmp_path);
+    return;
+  }
+
+  std::vector<uint8_t> data;
+  auto write_field = [&](const void *in, size_t size) {
+    const uint8_t *bytes = (const uint8_t *)in;
+    data.insert(data.end(), bytes, bytes + size);
+  };
+
+  uint32_t magic = PROGRAM_CACHE_MAGIC;
+  uint32_t num_entries = program_binaries_.size();
+  write_field(&magic, sizeof(magic));
+  write_field(&program_cache_driver_hash_, sizeof(program_cache_driver_hash_));
+  write_field(&num_entries, sizeof(num_entries));
+  for (auto &entry : program_binaries_) {
+    uint32_t format = entry.second.format;
+    uint32_t size = entry.second.data.size();
+    write_field(&entry.first, sizeof(entry.first));
+    write_field(&format, sizeof(format));
+    write_field(&size, sizeof(size));
+    write_field(entry.second.data.data(), size);
+  }
+
+  if (write(fd.get(), data.data(), data.size()) != (ssize_t)data.size() ||
+      fsync(fd.get())) {
+    save_failed("write", tmp_path);
+    unlink(tmp_path.c_str());
+    return;
+  }
+  fd.Close();
+
+  if (rename(tmp_path.c_str(), program_cache_path_.c_str())) {
+    save_failed("rename", tmp_path);
+    unlink(tmp_path.c_str());
+    return;
+  }
+  program_cache_dirty_ = false;
+}
+
+AutoGLProgram GLWorkerCompositor::LoadProgramBinary(uint64_t key) {
+  auto it = program_binaries_.find(key);
+  if (it == program_binaries_.end())
+    return 0;
+
+  AutoGLProgram program(glCreateProgram());
+  glProgramBinaryOES(program.get(), it->second.format, it->second.data.data(),
+                     it->second.data.size());
+  GLint status;
+  glGetProgramiv(program.get(), GL_LINK_STATUS, &status);
+  if (!status) {
+    // The driver rejected the binary, fall back to compiling from source
+    program_binaries_.erase(it);
+    program_cache_dirty_ = true;
+    return 0;
+  }
+
+  return program;
+}
+
+void GLWorkerCompositor::StoreProgramBinary(uint64_t key, GLint program) {
+  if (program_cache_path_.empty())
+    return;
+
+  GLint length = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+  if (length <= 0)
+    return;
+
+  ProgramBinary binary;
+  binary.data.resize(length);
+  glGetProgramBinaryOES(program, length, &length, &binary.format,
+                        binary.data.data());
+  if (length <= 0)
+    return;
+  binary.data.resize(length);
+
+  program_binaries_[key] = std::move(binary);
+  program_cache_dirty_ = true;
+}
+
+GLuint GLWorkerCompositor::PrepareAndCacheTexture(DrmHwcLayer *layer,
+                                                  Importer *importer) {
+  buffer_handle_t handle = layer->get_usable_handle();
+  ino_t inode = 0;
+  struct stat buffer_stat;
+  if (handle->numFds > 0 && !fstat(handle->data[0], &buffer_stat))
+    inode = buffer_stat.st_ino;
+
+  const DrmHwcBuffer &bo = layer->buffer;
+  for (auto it = cached_textures_.begin(); it != cached_textures_.end(); ++it) {
+    if (it->handle != layer->sf_handle)
+      continue;
+
+    if (it->width == bo->width && it->height == bo->height &&
+        it->format == bo->format && it->pitch == bo->pitches[0] &&
+        it->inode == inode) {
+      it->last_used = texture_cache_serial_;
+      return it->image_and_texture.texture.get();
+    }
+
+    // The handle has been recycled for a different buffer
+    texture_cache_bytes_ -= it->size;
+    cached_textures_.erase(it);
+    break;
+  }
+
+  CachedTexture cached;
+  int ret = CreateTextureFromHandle(egl_display_, handle, &layer->buffer,
+                                    importer, &cached.image_and_texture);
+  if (ret)
+    return 0;
+
+  cached.handle = layer->sf_handle;
+  cached.width = bo->width;
+  cached.height = bo->height;
+  cached.format = bo->format;
+  cached.pitch = bo->pitches[0];
+  cached.inode = inode;
+  cached.size = 0;
+  for (int i = 0; i < 4; i++)
+    cached.size += (size_t)bo->pitches[i] * bo->height;
+  cached.last_used = texture_cache_serial_;
+
+  texture_cache_bytes_ += cached.size;
+  cached_textures_.emplace_back(std::move(cached));
+  return cached_textures_.back().image_and_texture.texture.get();
+}
+
+void GLWorkerCompositor::SetTextureCacheImporter(Importer *importer) {
+  if (texture_cache_importer_ == importer)
+    return;
+
+  if (texture_cache_importer_ && texture_cache_has_free_callback_)
+    texture_cache_importer_->RemoveFreeCallback(HandleBufferFreed, this);
+
+  // Images imported by a different importer can't be trusted to match
+  ClearTextureCache();
+
+  texture_cache_importer_ = importer;
+  texture_cache_has_free_callback_ =
+      importer && !importer->AddFreeCallback(HandleBufferFreed, this);
+}
+
+void GLWorkerCompositor::ReleaseFreedTextures() {
+  std::vector<buffer_handle_t> freed_handles;
+  AutoLock lock(&freed_handles_lock_, "ReleaseFreedTextures");
+  if (lock.Lock())
+    return;
+  freed_handles.swap(freed_handles_);
+  lock.Unlock();
+
+  for (buffer_handle_t handle : freed_handles) {
+    for (auto it = cached_textures_.begin(); it != cached_textures_.end();
+         ++it) {
+      if (it->handle == handle) {
+        texture_cache_bytes_ -= it->size;
+        cached_textures_.erase(it);
+        break;
+      }
+    }
+  }
+}
+
+void GLWorkerCompositor::TrimTextureCache() {
+  // Evict the least recently used textures, but never ones used by the
+  // current composite
+  while (cached_textures_.size() > texture_cache_max_count_ ||
+         texture_cache_bytes_ > texture_cache_max_bytes_) {
+    auto lru = std::min_element(
+        cached_textures_.begin(), cached_textures_.end(),
+        [](const CachedTexture &a, const CachedTexture &b) {
+          return a.last_used < b.last_used;
+        });
+    if (lru == cached_textures_.end() ||
+        lru->last_used == texture_cache_serial_)
+      break;
+
+    texture_cache_bytes_ -= lru->size;
+    cached_textures_.erase(lru);
+  }
+}
+
+void GLWorkerCompositor::ClearTextureCache() {
+  cached_textures_.clear();
+  texture_cache_bytes_ = 0;
+}
+
+// static
+void GLWorkerCompositor::HandleBufferFreed(void *data, buffer_handle_t handle) {
+  GLWorkerCompositor *compositor = (GLWorkerCompositor *)data;
+  AutoLock lock(&compositor->freed_handles_lock_, "HandleBufferFreed");
+  if (lock.Lock())
+    return;
+  compositor->freed_handles_.push_back(handle);
 }
 
 }  // namespace android
@@ -17,6 +17,12 @@
 #ifndef ANDROID_GL_WORKER_H_
 #define ANDROID_GL_WORKER_H_
 
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <map>
+#include <sstream>
+#include <string>
 #include <vector>
 
 #define EGL_EGLEXT_PROTOTYPES
@@ -26,26 +32,55 @@
 #include <EGL/eglext.h>
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
+#include <GLES3/gl3.h>
 
 #include <ui/GraphicBuffer.h>
 
+#include "autofd.h"
 #include "autogl.h"
+#include "drmhwcomposer.h"
 
 namespace android {
 
 struct DrmHwcLayer;
 struct DrmCompositionRegion;
+struct RenderingCommand;
+
+// A program whose shaders have been handed to the driver, but whose link
+// status hasn't been queried yet
+struct PendingGLProgram {
+  AutoGLShader vertex_shader;
+  AutoGLShader fragment_shader;
+  AutoGLProgram program;
+};
 
+// Composites layers with GL. Init makes the compositor's EGL context current on
+// the calling thread and leaves it there, so the compositor must only be used
+// and destroyed on that thread. GLCompositorWorker provides such a thread.
 class GLWorkerCompositor {
  public:
   GLWorkerCompositor();
   ~GLWorkerCompositor();
 
   int Init();
+  // Renders the part of the display described by frame into framebuffer,
+  // with the top left corner of frame at the top left of framebuffer and
+  // every dimension multiplied by scale. Rendering starts once
+  // framebuffer_fence, if valid, has signaled. On success, out_fence is set to a
+  // fence that signals once rendering to framebuffer completes, or -1 if
+  // rendering has already completed.
   int Composite(DrmHwcLayer *layers, DrmCompositionRegion *regions,
                 size_t num_regions, const sp<GraphicBuffer> &framebuffer,
-                Importer *importer);
+                UniqueFd framebuffer_fence, const DrmHwcRect<int> &frame,
+                float scale, Importer *importer, UniqueFd *out_fence);
   void Finish();
+  // Builds one of the specialized programs that were deferred to keep
+  // compilation off the frame path, or saves new program binaries once there
+  // are none left. Returns whether there may be more to build.
+  bool BuildDeferredVariant();
+  // Drops every framebuffer cached for rendering. Buffers that are still used
+  // are cached again the next time they're rendered to.
+  void ClearFramebufferCache();
 
  private:
   struct CachedFramebuffer {
@@ -64,30 +99,116 @@ class GLWorkerCompositor {
     bool Promote();
   };
 
-  struct {
-    EGLDisplay saved_egl_display = EGL_NO_DISPLAY;
-    EGLContext saved_egl_ctx = EGL_NO_CONTEXT;
-    EGLSurface saved_egl_read = EGL_NO_SURFACE;
-    EGLSurface saved_egl_draw = EGL_NO_SURFACE;
-  } private_;
+  // Source textures are keyed by the handle surfaceflinger gave us, which is
+  // stable for the lifetime of the buffer. The remaining fields guard against
+  // the handle being recycled for a different buffer.
+  struct CachedTexture {
+    buffer_handle_t handle;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    uint32_t pitch;
+    ino_t inode;
+    size_t size;
+    uint64_t last_used;
+    AutoEGLImageAndGLTexture image_and_texture;
+  };
+
+  struct BlendProgram {
+    AutoGLProgram program;
+    PendingGLProgram pending;
+
+    // Uniform locations, per source layer where applicable. Uniforms that a
+    // specialized program bakes in resolve to -1, which GL silently ignores.
+    GLint viewport_loc = -1;
+    GLint dither_scale_loc = -1;
+    std::vector<GLint> crop_locs;
+    std::vector<GLint> alpha_locs;
+    std::vector<GLint> premult_locs;
+    std::vector<GLint> tex_matrix_locs;
+    std::vector<GLint> texture_locs;
+
+    // Per layer descriptor of the configuration a specialized program was
+    // generated for, empty for the generic programs
+    std::string variant;
+    uint64_t last_used = 0;
+    // Hash of the sources, which the program binary is cached under
+    uint64_t key = 0;
+    // Waiting to be built while the compositor is idle
+    bool deferred = false;
+
+    void ResolveUniforms(unsigned layer_count);
+  };
 
-  int BeginContext();
-  int EndContext();
+  struct ProgramBinary {
+    GLenum format = 0;
+    std::vector<uint8_t> data;
+  };
 
   CachedFramebuffer *FindCachedFramebuffer(
       const sp<GraphicBuffer> &framebuffer);
   CachedFramebuffer *PrepareAndCacheFramebuffer(
       const sp<GraphicBuffer> &framebuffer);
 
-  GLint PrepareAndCacheProgram(unsigned texture_count);
+  int DrawCommand(const RenderingCommand &cmd, const GLuint *layer_textures,
+                  const GLint *viewport, const float *dither_scale);
+
+  const BlendProgram *PrepareAndCacheProgram(unsigned texture_count);
+  const BlendProgram *PrepareAndCacheVariant(const RenderingCommand &cmd);
+  bool FinishVariant(BlendProgram *variant, bool wait);
+  int BuildBlendPrograms(std::ostringstream *shader_log);
+
+  void LoadProgramCache();
+  void SaveProgramCache();
+  AutoGLProgram LoadProgramBinary(uint64_t key);
+  void StoreProgramBinary(uint64_t key, GLint program);
+
+  GLuint PrepareAndCacheTexture(DrmHwcLayer *layer, Importer *importer);
+  void SetTextureCacheImporter(Importer *importer);
+  void ReleaseFreedTextures();
+  void TrimTextureCache();
+  void ClearTextureCache();
+  static void HandleBufferFreed(void *data, buffer_handle_t handle);
 
   EGLDisplay egl_display_;
   EGLContext egl_ctx_;
 
-  std::vector<AutoGLProgram> blend_programs_;
+  std::vector<BlendProgram> blend_programs_;
   AutoGLBuffer vertex_buffer_;
 
+  // Programs specialized for the blending configuration of a region, kept in
+  // a small LRU cache and persisted with the program binaries. They are built
+  // in the background if the driver supports KHR_parallel_shader_compile, or
+  // else in between jobs, using the generic programs above until they are
+  // ready.
+  bool parallel_shader_compile_ = false;
+  size_t variant_cache_max_count_ = 0;
+  uint64_t variant_serial_ = 0;
+  std::vector<BlendProgram> variant_programs_;
+
+  // Program binaries persisted across boots, keyed by a hash of the shader
+  // sources and only valid for the driver hashed in program_cache_driver_hash_
+  std::string program_cache_path_;
+  uint64_t program_cache_driver_hash_ = 0;
+  bool program_cache_dirty_ = false;
+  bool program_cache_save_failed_ = false;
+  std::map<uint64_t, ProgramBinary> program_binaries_;
+
   std::vector<CachedFramebuffer> cached_framebuffers_;
+
+  size_t texture_cache_max_count_ = 0;
+  size_t texture_cache_max_bytes_ = 0;
+  size_t texture_cache_bytes_ = 0;
+  uint64_t texture_cache_serial_ = 0;
+  std::vector<CachedTexture> cached_textures_;
+
+  // Buffers freed by gralloc are reported on arbitrary threads, so they are
+  // queued here and their textures are released the next time the context is
+  // current.
+  Importer *texture_cache_importer_ = NULL;
+  bool texture_cache_has_free_callback_ = false;
+  pthread_mutex_t freed_handles_lock_ = PTHREAD_MUTEX_INITIALIZER;
+  std::vector<buffer_handle_t> freed_handles_;
 };
 }
 
@@ -20,6 +20,7 @@
 #include "drmdisplaycomposition.h"
 #include "drmhwcomposer.h"
 
+#include <errno.h>
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
 
@@ -60,6 +61,21 @@ class Importer {
   // Note: This can be called from a different thread than ImportBuffer. The
   //       implementation is responsible for ensuring thread safety.
   virtual int CreateFrameBuffer(hwc_drm_bo_t *bo, uint32_t plane_type) = 0;
+
+  typedef void (*FreeCallback)(void *data, buffer_handle_t handle);
+
+  // Registers callback to be invoked with the handle originally passed to
+  // ImportBuffer once gralloc frees that buffer. This allows state derived from
+  // the buffer (ie: cached EGLImages) to be dropped as soon as it goes away.
+  // Returns -ENOTSUP if the platform can't track the lifetime of buffers.
+  //
+  // Note: The callback may be invoked from any thread. It must be removed with
+  //       RemoveFreeCallback before data is destroyed.
+  virtual int AddFreeCallback(FreeCallback /*callback*/, void * /*data*/) {
+    return -ENOTSUP;
+  }
+  virtual void RemoveFreeCallback(FreeCallback /*callback*/, void * /*data*/) {
+  }
 };
 
 class Planner {
@@ -16,10 +16,12 @@
 
 #define LOG_TAG "hwc-platform-nv"
 
+#include "autolock.h"
 #include "drmresources.h"
 #include "platform.h"
 #include "platformnv.h"
 
+#include <algorithm>
 #include <cinttypes>
 #include <stdatomic.h>
 #include <xf86drm.h>
@@ -97,6 +99,7 @@ int NvImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   }
   buf->bo.priv = buf;
   buf->importer = this;
+  buf->handle = handle;
 
   // We initialize the reference count to 2 since NvGralloc is still using this
   // buffer (will be cleared in the NvGrallocRelease), and the other
@@ -154,10 +157,40 @@ int NvImporter::ReleaseBuffer(hwc_drm_bo_t *bo) {
   return 0;
 }
 
+int NvImporter::AddFreeCallback(FreeCallback callback, void *data) {
+  AutoLock lock(&free_callbacks_lock_, "AddFreeCallback");
+  int ret = lock.Lock();
+  if (ret)
+    return ret;
+
+  free_callbacks_.emplace_back(callback, data);
+  return 0;
+}
+
+void NvImporter::RemoveFreeCallback(FreeCallback callback, void *data) {
+  AutoLock lock(&free_callbacks_lock_, "RemoveFreeCallback");
+  if (lock.Lock())
+    return;
+
+  free_callbacks_.erase(
+      std::remove(free_callbacks_.begin(), free_callbacks_.end(),
+                  std::make_pair(callback, data)),
+      free_callbacks_.end());
+}
+
 // static
 void NvImporter::NvGrallocRelease(void *nv_buffer) {
   NvBuffer_t *buf = (NvBuffer *)nv_buffer;
-  buf->importer->ReleaseBuffer(&buf->bo);
+  NvImporter *importer = buf->importer;
+
+  AutoLock lock(&importer->free_callbacks_lock_, "NvGrallocRelease");
+  if (!lock.Lock()) {
+    for (auto &callback : importer->free_callbacks_)
+      callback.first(callback.second, buf->handle);
+    lock.Unlock();
+  }
+
+  importer->ReleaseBuffer(&buf->bo);
 }
 
 void NvImporter::ReleaseBufferImpl(hwc_drm_bo_t *bo) {
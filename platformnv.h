@@ -21,6 +21,7 @@
 #include "platform.h"
 #include "platformdrmgeneric.h"
 
+#include <pthread.h>
 #include <stdatomic.h>
 
 #include <hardware/gralloc.h>
@@ -39,10 +40,13 @@ class NvImporter : public Importer {
   int ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) override;
   int ReleaseBuffer(hwc_drm_bo_t *bo) override;
   int CreateFrameBuffer(hwc_drm_bo_t *bo, uint32_t plane_type) override;
+  int AddFreeCallback(FreeCallback callback, void *data) override;
+  void RemoveFreeCallback(FreeCallback callback, void *data) override;
 
  private:
   typedef struct NvBuffer {
     NvImporter *importer;
+    buffer_handle_t handle;
     hwc_drm_bo_t bo;
     atomic_int ref;
   } NvBuffer_t;
@@ -56,6 +60,9 @@ class NvImporter : public Importer {
   DrmResources *drm_;
 
   const gralloc_module_t *gralloc_;
+
+  pthread_mutex_t free_callbacks_lock_ = PTHREAD_MUTEX_INITIALIZER;
+  std::vector<std::pair<FreeCallback, void *>> free_callbacks_;
 };
 
 // This stage looks for any layers that contain transformed protected content
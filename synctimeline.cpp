@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-sync-timeline"
+
+#include "synctimeline.h"
+#include "autolock.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+#include <sw_sync.h>
+
+namespace android {
+
+SyncTimeline::SyncTimeline(const char *name)
+    : name_(name),
+      timeline_fd_(-1),
+      reserved_(0),
+      current_(0),
+      fences_created_(0),
+      points_signaled_(0) {
+  pthread_mutex_init(&lock_, NULL);
+}
+
+SyncTimeline::~SyncTimeline() {
+  // Nothing may wait on the timeline forever once it's gone
+  if (timeline_fd_ >= 0) {
+    if (reserved_ != current_)
+      sw_sync_timeline_inc(timeline_fd_, reserved_ - current_);
+    close(timeline_fd_);
+  }
+  pthread_mutex_destroy(&lock_);
+}
+
+int SyncTimeline::Init() {
+  int ret = sw_sync_timeline_create();
+  if (ret < 0) {
+    ALOGE("Failed to create %s sw sync timeline %d", name_, ret);
+    return ret;
+  }
+  timeline_fd_ = ret;
+  return 0;
+}
+
+uint32_t SyncTimeline::ReservePoint() {
+  AutoLock lock(&lock_, name_);
+  if (lock.Lock())
+    return current_;
+  return ++reserved_;
+}
+
+int SyncTimeline::CreateFence(uint32_t point) {
+  if (timeline_fd_ < 0)
+    return -ENODEV;
+
+  int fd = sw_sync_fence_create(timeline_fd_, name_, point);
+  if (fd < 0) {
+    ALOGE("Failed to create %s fence %d", name_, fd);
+    return fd;
+  }
+
+  AutoLock lock(&lock_, name_);
+  if (!lock.Lock())
+    fences_created_++;
+  return fd;
+}
+
+void SyncTimeline::Signal(uint32_t point) {
+  if (timeline_fd_ < 0)
+    return;
+
+  AutoLock lock(&lock_, name_);
+  if (lock.Lock())
+    return;
+
+  if (!IsBefore(current_, point) || IsBefore(reserved_, point))
+    return;
+  if (!signaled_.insert(point).second)
+    return;
+  points_signaled_++;
+
+  uint32_t target = current_;
+  while (signaled_.erase(target + 1))
+    target++;
+  if (target == current_)
+    return;
+
+  int ret = sw_sync_timeline_inc(timeline_fd_, target - current_);
+  if (ret) {
+    ALOGE("Failed to increment %s timeline %d", name_, ret);
+    return;
+  }
+  current_ = target;
+}
+
+void SyncTimeline::Dump(std::ostringstream *out) const {
+  AutoLock lock(&lock_, name_);
+  if (lock.Lock())
+    return;
+
+  *out << "----Timeline " << name_ << " current=" << current_
+       << " reserved=" << reserved_
+       << " pending=" << (uint32_t)(reserved_ - current_)
+       << " signaled_out_of_order=" << signaled_.size()
+       << " fences_created=" << fences_created_
+       << " points_signaled=" << points_signaled_ << "\n";
+}
+}
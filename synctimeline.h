@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_SYNC_TIMELINE_H_
+#define ANDROID_SYNC_TIMELINE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <sstream>
+#include <unordered_set>
+
+namespace android {
+
+// A sw_sync timeline that lives as long as its display. Points are reserved in
+// order but may be signaled in any order, as compositions aren't always
+// destroyed in the order they were created. The timeline only advances past a
+// point once it and every point before it have been signaled, so a fence
+// never signals early because a later point was done first.
+class SyncTimeline {
+ public:
+  SyncTimeline(const char *name);
+  ~SyncTimeline();
+
+  int Init();
+
+  uint32_t ReservePoint();
+  // Returns a new fence that signals once point has been reached, or a
+  // negative error code
+  int CreateFence(uint32_t point);
+  // Signaling a point more than once is harmless
+  void Signal(uint32_t point);
+
+  void Dump(std::ostringstream *out) const;
+
+ private:
+  SyncTimeline(const SyncTimeline &) = delete;
+
+  // Whether point a comes before point b, allowing for wraparound
+  static bool IsBefore(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+  }
+
+  const char *name_;
+  int timeline_fd_;
+
+  mutable pthread_mutex_t lock_;
+  uint32_t reserved_;
+  uint32_t current_;
+  std::unordered_set<uint32_t> signaled_;
+
+  // Every fence handed out is owned by whoever it went to, these only show
+  // whether they keep getting created and points keep getting signaled
+  uint64_t fences_created_;
+  uint64_t points_signaled_;
+};
+}
+
+#endif  // ANDROID_SYNC_TIMELINE_H_
@@ -17,36 +17,76 @@
 #define LOG_TAG "hwc-virtual-compositor-worker"
 
 #include "virtualcompositorworker.h"
+#include "autolock.h"
 #include "worker.h"
 
 #include <errno.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <cutils/log.h>
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
-#include <sched.h>
 #include <sw_sync.h>
 #include <sync/sync.h>
 
 namespace android {
 
-static const int kMaxQueueDepth = 3;
 static const int kAcquireWaitTimeoutMs = 3000;
 
+static int64_t GetTimeNs() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+  return ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+// Adds a sample to a total and maximum only ever written by one thread
+static void RecordSample(std::atomic<int64_t> *total, std::atomic<int64_t> *max,
+                         int64_t sample) {
+  total->store(total->load(std::memory_order_relaxed) + sample,
+               std::memory_order_relaxed);
+  if (sample > max->load(std::memory_order_relaxed))
+    max->store(sample, std::memory_order_relaxed);
+}
+
 VirtualCompositorWorker::VirtualCompositorWorker()
     : Worker("virtual-compositor", HAL_PRIORITY_URGENT_DISPLAY),
+      exiting_(false),
       timeline_fd_(-1),
       timeline_(0),
-      timeline_current_(0) {
+      timeline_current_(0),
+      dump_compositions_(0),
+      dump_queue_latency_total_ns_(0),
+      dump_queue_latency_max_ns_(0),
+      dump_producer_stalls_(0),
+      dump_producer_stall_total_ns_(0),
+      dump_producer_stall_max_ns_(0),
+      dump_acquire_timeouts_(0) {
+  pthread_mutex_init(&queue_lock_, NULL);
+  pthread_cond_init(&queue_cond_, NULL);
 }
 
 VirtualCompositorWorker::~VirtualCompositorWorker() {
+  // The thread waits on queue_cond_ rather than for a signal, so it has to be
+  // woken up before Exit() can join it. Compositions it didn't get to are
+  // signaled below.
+  if (initialized()) {
+    pthread_mutex_lock(&queue_lock_);
+    exiting_ = true;
+    pthread_cond_broadcast(&queue_cond_);
+    pthread_mutex_unlock(&queue_lock_);
+    Exit();
+  }
+  queue_.clear();
+
   if (timeline_fd_ >= 0) {
     FinishComposition(timeline_);
     close(timeline_fd_);
     timeline_fd_ = -1;
   }
+  pthread_cond_destroy(&queue_cond_);
+  pthread_mutex_destroy(&queue_lock_);
 }
 
 int VirtualCompositorWorker::Init() {
@@ -62,6 +102,10 @@ int VirtualCompositorWorker::Init() {
 void VirtualCompositorWorker::QueueComposite(hwc_display_contents_1_t *dc) {
   std::unique_ptr<VirtualComposition> composition(new VirtualComposition);
 
+  AutoLock lock(&queue_lock_, "virtual-compositor");
+  if (lock.Lock())
+    return;
+
   composition->outbuf_acquire_fence.Set(dc->outbufAcquireFenceFd);
   dc->outbufAcquireFenceFd = -1;
   if (dc->retireFenceFd >= 0)
@@ -81,49 +125,48 @@ void VirtualCompositorWorker::QueueComposite(hwc_display_contents_1_t *dc) {
 
   composition->release_timeline = timeline_;
 
-  Lock();
-  while (composite_queue_.size() >= kMaxQueueDepth) {
-    Unlock();
-    sched_yield();
-    Lock();
+  int64_t stall_start_ns = -1;
+  while (queue_.size() >= kMaxQueueDepth && !exiting_) {
+    if (stall_start_ns < 0)
+      stall_start_ns = GetTimeNs();
+    pthread_cond_wait(&queue_cond_, &queue_lock_);
+  }
+  if (stall_start_ns >= 0) {
+    dump_producer_stalls_.store(
+        dump_producer_stalls_.load(std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed);
+    RecordSample(&dump_producer_stall_total_ns_, &dump_producer_stall_max_ns_,
+                 GetTimeNs() - stall_start_ns);
   }
 
-  composite_queue_.push(std::move(composition));
-  SignalLocked();
-  Unlock();
+  composition->queued_ns = GetTimeNs();
+  queue_.emplace_back(std::move(composition));
+  pthread_cond_broadcast(&queue_cond_);
 }
 
 void VirtualCompositorWorker::Routine() {
-  int ret = Lock();
+  AutoLock lock(&queue_lock_, "virtual-compositor");
+  int ret = lock.Lock();
   if (ret) {
     ALOGE("Failed to lock worker, %d", ret);
     return;
   }
 
-  int wait_ret = 0;
-  if (composite_queue_.empty()) {
-    wait_ret = WaitForSignalOrExitLocked();
-  }
-
-  std::unique_ptr<VirtualComposition> composition;
-  if (!composite_queue_.empty()) {
-    composition = std::move(composite_queue_.front());
-    composite_queue_.pop();
-  }
-
-  ret = Unlock();
-  if (ret) {
-    ALOGE("Failed to unlock worker, %d", ret);
+  while (queue_.empty() && !exiting_)
+    pthread_cond_wait(&queue_cond_, &queue_lock_);
+  if (exiting_)
     return;
-  }
 
-  if (wait_ret == -EINTR) {
-    return;
-  } else if (wait_ret) {
-    ALOGE("Failed to wait for signal, %d", wait_ret);
-    return;
-  }
+  std::unique_ptr<VirtualComposition> composition = std::move(queue_.front());
+  queue_.pop_front();
+  pthread_cond_broadcast(&queue_cond_);
+  lock.Unlock();
 
+  dump_compositions_.store(
+      dump_compositions_.load(std::memory_order_relaxed) + 1,
+      std::memory_order_relaxed);
+  RecordSample(&dump_queue_latency_total_ns_, &dump_queue_latency_max_ns_,
+               GetTimeNs() - composition->queued_ns);
   Compose(std::move(composition));
 }
 
@@ -144,34 +187,72 @@ int VirtualCompositorWorker::FinishComposition(int point) {
   return ret;
 }
 
+int VirtualCompositorWorker::MergeAcquireFences(VirtualComposition *composition,
+                                                UniqueFd *merged) {
+  *merged = std::move(composition->outbuf_acquire_fence);
+  for (UniqueFd &fence : composition->layer_acquire_fences) {
+    if (fence.get() < 0)
+      continue;
+    if (merged->get() < 0) {
+      *merged = std::move(fence);
+      continue;
+    }
+
+    int merged_fence = sync_merge("virtual acquire", merged->get(), fence.get());
+    if (merged_fence >= 0) {
+      merged->Set(merged_fence);
+      fence.Close();
+      continue;
+    }
+
+    ALOGW("Failed to merge acquire fences %d", merged_fence);
+    int ret = sync_wait(merged->get(), kAcquireWaitTimeoutMs);
+    if (ret)
+      return ret;
+    *merged = std::move(fence);
+  }
+  return 0;
+}
+
 void VirtualCompositorWorker::Compose(
     std::unique_ptr<VirtualComposition> composition) {
   if (!composition.get())
     return;
 
-  int ret;
-  int outbuf_acquire_fence = composition->outbuf_acquire_fence.get();
-  if (outbuf_acquire_fence >= 0) {
-    ret = sync_wait(outbuf_acquire_fence, kAcquireWaitTimeoutMs);
-    if (ret) {
-      ALOGE("Failed to wait for outbuf acquire %d/%d", outbuf_acquire_fence,
-            ret);
-      return;
-    }
-    composition->outbuf_acquire_fence.Close();
-  }
-  for (size_t i = 0; i < composition->layer_acquire_fences.size(); ++i) {
-    int layer_acquire_fence = composition->layer_acquire_fences[i].get();
-    if (layer_acquire_fence >= 0) {
-      ret = sync_wait(layer_acquire_fence, kAcquireWaitTimeoutMs);
-      if (ret) {
-        ALOGE("Failed to wait for layer acquire %d/%d", layer_acquire_fence,
-              ret);
-        return;
-      }
-      composition->layer_acquire_fences[i].Close();
-    }
+  UniqueFd acquire_fence;
+  int ret = MergeAcquireFences(composition.get(), &acquire_fence);
+  if (!ret && acquire_fence.get() >= 0)
+    ret = sync_wait(acquire_fence.get(), kAcquireWaitTimeoutMs);
+  if (ret) {
+    ALOGE("Failed to wait for acquire fences %d", ret);
+    dump_acquire_timeouts_.store(
+        dump_acquire_timeouts_.load(std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed);
+    return;
   }
   FinishComposition(composition->release_timeline);
 }
+
+void VirtualCompositorWorker::Dump(std::ostringstream *out) const {
+  uint64_t compositions = dump_compositions_.load(std::memory_order_relaxed);
+  uint64_t stalls = dump_producer_stalls_.load(std::memory_order_relaxed);
+  *out << "Virtual compositor: compositions=" << compositions
+       << " acquire_timeouts="
+       << dump_acquire_timeouts_.load(std::memory_order_relaxed);
+  if (compositions)
+    *out << " queue_latency_us[avg/max]="
+         << dump_queue_latency_total_ns_.load(std::memory_order_relaxed) /
+                (int64_t)compositions / 1000
+         << "/"
+         << dump_queue_latency_max_ns_.load(std::memory_order_relaxed) / 1000;
+  *out << " producer_stalls=" << stalls;
+  if (stalls)
+    *out << " producer_stall_us[avg/max]="
+         << dump_producer_stall_total_ns_.load(std::memory_order_relaxed) /
+                (int64_t)stalls / 1000
+         << "/"
+         << dump_producer_stall_max_ns_.load(std::memory_order_relaxed) / 1000;
+  *out << "\n";
+  DumpScheduling(out);
+}
 }
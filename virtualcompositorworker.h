@@ -20,7 +20,13 @@
 #include "drmhwcomposer.h"
 #include "worker.h"
 
-#include <queue>
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <sstream>
+#include <vector>
 
 namespace android {
 
@@ -30,8 +36,11 @@ class VirtualCompositorWorker : public Worker {
   ~VirtualCompositorWorker() override;
 
   int Init();
+  // Blocks while kMaxQueueDepth compositions are waiting for their fences
   void QueueComposite(hwc_display_contents_1_t *dc);
 
+  void Dump(std::ostringstream *out) const;
+
  protected:
   void Routine() override;
 
@@ -40,16 +49,38 @@ class VirtualCompositorWorker : public Worker {
     UniqueFd outbuf_acquire_fence;
     std::vector<UniqueFd> layer_acquire_fences;
     int release_timeline;
+    int64_t queued_ns;
   };
 
+  static const size_t kMaxQueueDepth = 3;
+
   int CreateNextTimelineFence();
   int FinishComposition(int timeline);
+  // Merges every acquire fence of the composition into one, so they're
+  // waited for at once. Whatever can't be merged is waited for here instead.
+  int MergeAcquireFences(VirtualComposition *composition, UniqueFd *merged);
   void Compose(std::unique_ptr<VirtualComposition> composition);
 
-  std::queue<std::unique_ptr<VirtualComposition>> composite_queue_;
+  // Also protects timeline_, which producers advance as they create fences
+  pthread_mutex_t queue_lock_;
+  // Broadcast when a composition is queued or taken from the queue
+  pthread_cond_t queue_cond_;
+  std::deque<std::unique_ptr<VirtualComposition>> queue_;
+  bool exiting_;
+
   int timeline_fd_;
   int timeline_;
+  // Only accessed from the worker thread
   int timeline_current_;
+
+  // Not reset by Dump()
+  std::atomic<uint64_t> dump_compositions_;
+  std::atomic<int64_t> dump_queue_latency_total_ns_;
+  std::atomic<int64_t> dump_queue_latency_max_ns_;
+  std::atomic<uint64_t> dump_producer_stalls_;
+  std::atomic<int64_t> dump_producer_stall_total_ns_;
+  std::atomic<int64_t> dump_producer_stall_max_ns_;
+  std::atomic<uint64_t> dump_acquire_timeouts_;
 };
 }
 
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-vsync-model"
+
+#include "vsyncmodel.h"
+#include "autolock.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <cutils/log.h>
+
+namespace android {
+
+VSyncModel::VSyncModel()
+    : nominal_period_ns_(0),
+      outliers_(0),
+      locked_(false),
+      base_sequence_(0),
+      base_timestamp_ns_(0),
+      period_ns_(0) {
+  pthread_mutex_init(&lock_, NULL);
+}
+
+VSyncModel::~VSyncModel() {
+  pthread_mutex_destroy(&lock_);
+}
+
+void VSyncModel::Reset(int64_t nominal_period_ns) {
+  AutoLock lock(&lock_, "vsync-model");
+  if (lock.Lock())
+    return;
+
+  nominal_period_ns_ = nominal_period_ns;
+  samples_.clear();
+  outliers_ = 0;
+  locked_ = false;
+  period_ns_ = nominal_period_ns;
+}
+
+bool VSyncModel::AddSample(uint32_t sequence, int64_t timestamp_ns) {
+  AutoLock lock(&lock_, "vsync-model");
+  if (lock.Lock())
+    return false;
+
+  // Querying the current vblank twice within a frame gives the same sample
+  if (!samples_.empty() && samples_.back().first == sequence)
+    return true;
+
+  if (samples_.size() >= 2) {
+    double error = timestamp_ns - PredictLocked(sequence);
+    if (fabs(error) > kOutlierErrorNs) {
+      if (++outliers_ < kMaxOutliers)
+        return false;
+      ALOGI("Display timing changed, restarting vsync model");
+      samples_.clear();
+      locked_ = false;
+      period_ns_ = nominal_period_ns_;
+    }
+  }
+  outliers_ = 0;
+
+  samples_.emplace_back(sequence, timestamp_ns);
+  if (samples_.size() > kMaxSamples)
+    samples_.pop_front();
+  FitLocked();
+  return true;
+}
+
+void VSyncModel::FitLocked() {
+  base_sequence_ = samples_.front().first;
+  int64_t base_timestamp_ns = samples_.front().second;
+  if (samples_.size() < 2) {
+    base_timestamp_ns_ = base_timestamp_ns;
+    period_ns_ = nominal_period_ns_;
+    return;
+  }
+
+  // Sequence numbers wrap around, so they're taken relative to the oldest
+  double n = samples_.size();
+  double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+  for (const auto &sample : samples_) {
+    double x = (int32_t)(sample.first - base_sequence_);
+    double y = sample.second - base_timestamp_ns;
+    sum_x += x;
+    sum_y += y;
+    sum_xx += x * x;
+    sum_xy += x * y;
+  }
+  double variance = n * sum_xx - sum_x * sum_x;
+  if (variance <= 0)
+    return;
+  period_ns_ = (n * sum_xy - sum_x * sum_y) / variance;
+  base_timestamp_ns_ = base_timestamp_ns + (sum_y - period_ns_ * sum_x) / n;
+
+  double max_error = 0;
+  for (const auto &sample : samples_)
+    max_error =
+        fmax(max_error, fabs(sample.second - PredictLocked(sample.first)));
+  locked_ = samples_.size() >= kMinLockedSamples && period_ns_ > 0 &&
+            max_error <= kMaxLockedErrorNs;
+}
+
+double VSyncModel::PredictLocked(uint32_t sequence) const {
+  return base_timestamp_ns_ + (int32_t)(sequence - base_sequence_) * period_ns_;
+}
+
+bool VSyncModel::locked() const {
+  AutoLock lock(&lock_, "vsync-model");
+  if (lock.Lock())
+    return false;
+  return locked_;
+}
+
+int64_t VSyncModel::nominal_period() const {
+  AutoLock lock(&lock_, "vsync-model");
+  if (lock.Lock())
+    return 0;
+  return nominal_period_ns_;
+}
+
+int64_t VSyncModel::period() const {
+  AutoLock lock(&lock_, "vsync-model");
+  if (lock.Lock())
+    return 0;
+  return llround(period_ns_);
+}
+
+int64_t VSyncModel::GetNextVSync(int64_t time_ns) const {
+  AutoLock lock(&lock_, "vsync-model");
+  if (lock.Lock())
+    return -1;
+
+  if (samples_.empty() || period_ns_ <= 0)
+    return -1;
+
+  double frames = floor((time_ns - base_timestamp_ns_) / period_ns_) + 1;
+  return llround(base_timestamp_ns_ + frames * period_ns_);
+}
+}
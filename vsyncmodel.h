@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VSYNC_MODEL_H_
+#define ANDROID_VSYNC_MODEL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <utility>
+
+namespace android {
+
+// Predicts vblanks of a display from a few hardware timestamps. Period and
+// phase are a least squares fit of the timestamps against the vblank sequence
+// numbers the kernel reports, so samples don't need to come from consecutive
+// vblanks. Samples too far off the fit are rejected, unless enough of them
+// arrive in a row for the display timing to have changed.
+//
+// Safe to use from any thread.
+class VSyncModel {
+ public:
+  VSyncModel();
+  ~VSyncModel();
+
+  // Forgets every sample. Until new ones arrive, predictions are based on
+  // nominal_period_ns, unless that's 0.
+  void Reset(int64_t nominal_period_ns);
+  // Returns false if the sample was rejected as an outlier
+  bool AddSample(uint32_t sequence, int64_t timestamp_ns);
+
+  // Whether predictions are accurate enough to stand in for waiting on vblank
+  bool locked() const;
+  int64_t nominal_period() const;
+  // The fitted period, the nominal one without enough samples, or 0
+  int64_t period() const;
+  // Predicted time of the first vblank after time_ns, or -1 if nothing is
+  // known about the display timing
+  int64_t GetNextVSync(int64_t time_ns) const;
+
+ private:
+  static const size_t kMaxSamples = 16;
+  static const size_t kMinLockedSamples = 6;
+  static const int64_t kMaxLockedErrorNs = 100 * 1000;
+  static const int64_t kOutlierErrorNs = 1000 * 1000;
+  static const int kMaxOutliers = 3;
+
+  void FitLocked();
+  double PredictLocked(uint32_t sequence) const;
+
+  mutable pthread_mutex_t lock_;
+  int64_t nominal_period_ns_;
+  std::deque<std::pair<uint32_t, int64_t>> samples_;
+  int outliers_;
+  bool locked_;
+
+  // Vblank number base_sequence_ + n is predicted at base_timestamp_ns_ +
+  // n * period_ns_
+  uint32_t base_sequence_;
+  double base_timestamp_ns_;
+  double period_ns_;
+};
+}
+
+#endif  // ANDROID_VSYNC_MODEL_H_
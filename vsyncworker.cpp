@@ -18,71 +18,121 @@
 
 #include "drmresources.h"
 #include "vsyncworker.h"
-#include "worker.h"
 
+#include <algorithm>
 #include <map>
+#include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
 #include <time.h>
+#include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
 #include <hardware/hardware.h>
 
 namespace android {
 
+static const int64_t kOneSecondNs = 1 * 1000 * 1000 * 1000;
+
+static int64_t GetTimeNs() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+  return ts.tv_sec * kOneSecondNs + ts.tv_nsec;
+}
+
 VSyncWorker::VSyncWorker()
-    : Worker("vsync", HAL_PRIORITY_URGENT_DISPLAY),
-      drm_(NULL),
+    : drm_(NULL),
       display_(-1),
-      last_timestamp_(-1) {
+      enabled_(false),
+      last_timestamp_(-1),
+      initialized_(false),
+      timer_timestamp_(-1),
+      timer_source_(Source::kModel),
+      vblank_pending_(false),
+      model_(std::make_shared<VSyncModel>()),
+      mode_id_(0),
+      resample_frames_(0),
+      frames_since_sample_(0),
+      dump_vsyncs_(),
+      dump_latency_total_ns_(0),
+      dump_latency_max_ns_(0) {
+  pthread_mutex_init(&lock_, NULL);
 }
 
 VSyncWorker::~VSyncWorker() {
+  if (initialized_) {
+    drm_->event_listener()->RemoveFd(timer_fd_.get());
+    drm_->event_listener()->UnregisterVBlankHandler(this);
+  }
+  pthread_mutex_destroy(&lock_);
 }
 
 int VSyncWorker::Init(DrmResources *drm, int display) {
   drm_ = drm;
   display_ = display;
 
-  return InitWorker();
+  char resample_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.vsync_resample_frames", resample_opt, "60");
+  resample_frames_ = atoi(resample_opt);
+
+  timer_fd_.Set(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+  if (timer_fd_.get() < 0) {
+    ALOGE("Failed to create vsync timer %d", -errno);
+    return -errno;
+  }
+
+  int ret = drm_->event_listener()->AddFd(timer_fd_.get(), this);
+  if (ret)
+    return ret;
+  drm_->event_listener()->RegisterVBlankHandler(this);
+  initialized_ = true;
+  return 0;
 }
 
 int VSyncWorker::RegisterCallback(std::shared_ptr<VsyncCallback> callback) {
-  int ret = Lock();
-  if (ret) {
-    ALOGE("Failed to lock vsync worker lock %d\n", ret);
+  AutoLock lock(&lock_, "vsync");
+  int ret = lock.Lock();
+  if (ret)
     return ret;
-  }
 
   callback_ = callback;
-
-  ret = Unlock();
-  if (ret) {
-    ALOGE("Failed to unlock vsync worker lock %d\n", ret);
-    return ret;
-  }
   return 0;
 }
 
+void VSyncWorker::ResetModel() {
+  AutoLock lock(&lock_, "vsync");
+  if (lock.Lock())
+    return;
+
+  ResetModelLocked();
+  // Whatever the old model had armed goes by timing that no longer holds
+  ScheduleLocked();
+}
+
 int VSyncWorker::VSyncControl(bool enabled) {
-  int ret = Lock();
-  if (ret) {
-    ALOGE("Failed to lock vsync worker lock %d\n", ret);
+  AutoLock lock(&lock_, "vsync");
+  int ret = lock.Lock();
+  if (ret)
     return ret;
-  }
+
+  if (enabled_ == enabled)
+    return 0;
 
   enabled_ = enabled;
   last_timestamp_ = -1;
-  int signal_ret = SignalLocked();
-
-  ret = Unlock();
-  if (ret) {
-    ALOGE("Failed to unlock vsync worker lock %d\n", ret);
-    return ret;
-  }
-
-  return signal_ret;
+  // The model may have drifted while vsync was off
+  frames_since_sample_ = resample_frames_;
+  if (enabled)
+    ScheduleLocked();
+  else
+    ArmTimerLocked(0, Source::kModel);
+  return 0;
 }
 
 /*
@@ -106,97 +156,167 @@ int64_t VSyncWorker::GetPhasedVSync(int64_t frame_ns, int64_t current) {
          last_timestamp_;
 }
 
-static const int64_t kOneSecondNs = 1 * 1000 * 1000 * 1000;
+int64_t VSyncWorker::GetNextVSync(int64_t time_ns) const {
+  return model_->GetNextVSync(time_ns);
+}
 
-int VSyncWorker::SyntheticWaitVBlank(int64_t *timestamp) {
-  struct timespec vsync;
-  int ret = clock_gettime(CLOCK_MONOTONIC, &vsync);
+int64_t VSyncWorker::GetVSyncPeriod() const {
+  return model_->period();
+}
 
-  float refresh = 60.0f;  // Default to 60Hz refresh rate
+// The frame period of the active mode, or 0 if there isn't one
+int64_t VSyncWorker::GetNominalPeriod() {
   DrmConnector *conn = drm_->GetConnectorForDisplay(display_);
-  if (conn && conn->active_mode().v_refresh() != 0.0f)
-    refresh = conn->active_mode().v_refresh();
-  else
-    ALOGW("Vsync worker active with conn=%p refresh=%f\n", conn,
-          conn ? conn->active_mode().v_refresh() : 0.0f);
-
-  int64_t phased_timestamp = GetPhasedVSync(
-      kOneSecondNs / refresh, vsync.tv_sec * kOneSecondNs + vsync.tv_nsec);
-  vsync.tv_sec = phased_timestamp / kOneSecondNs;
-  vsync.tv_nsec = phased_timestamp - (vsync.tv_sec * kOneSecondNs);
-  do {
-    ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &vsync, NULL);
-  } while (ret == -1 && errno == EINTR);
-  if (ret)
-    return ret;
+  if (!conn || conn->active_mode().v_refresh() == 0.0f)
+    return 0;
+  return kOneSecondNs / conn->active_mode().v_refresh();
+}
 
-  *timestamp = (int64_t)vsync.tv_sec * kOneSecondNs + (int64_t)vsync.tv_nsec;
+// Forgets the timing learnt so far, and the phase of the last vsync, so
+// vblank events are waited for until the model has locked again
+void VSyncWorker::ResetModelLocked() {
+  model_->Reset(GetNominalPeriod());
+  last_timestamp_ = -1;
+  frames_since_sample_ = resample_frames_;
+}
+
+// Arms the timer to fire at timestamp, or disarms it if timestamp is 0
+int VSyncWorker::ArmTimerLocked(int64_t timestamp, Source source) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = timestamp / kOneSecondNs;
+  spec.it_value.tv_nsec = timestamp % kOneSecondNs;
+  if (timerfd_settime(timer_fd_.get(), TFD_TIMER_ABSTIME, &spec, NULL)) {
+    ALOGE("Failed to set vsync timer %d", -errno);
+    return -errno;
+  }
+  timer_timestamp_ = timestamp;
+  timer_source_ = source;
   return 0;
 }
 
-void VSyncWorker::Routine() {
-  int ret = Lock();
-  if (ret) {
-    ALOGE("Failed to lock worker %d", ret);
+// Sets up delivering the next vsync, unless a vblank event is still pending
+void VSyncWorker::ScheduleLocked() {
+  if (!enabled_ || vblank_pending_)
     return;
+
+  // What the model learnt only holds for the mode it learnt it in, even if
+  // the new one has the same nominal rate
+  DrmConnector *conn = drm_->GetConnectorForDisplay(display_);
+  if (conn && conn->active_mode().id() != mode_id_) {
+    mode_id_ = conn->active_mode().id();
+    ResetModelLocked();
   }
 
-  if (!enabled_) {
-    ret = WaitForSignalOrExitLocked();
-    if (ret == -EINTR) {
+  int64_t nominal_period = GetNominalPeriod();
+  if (nominal_period && nominal_period != model_->nominal_period())
+    model_->Reset(nominal_period);
+
+  int64_t now = GetTimeNs();
+  if (resample_frames_ > 0 && frames_since_sample_ < resample_frames_ &&
+      model_->locked()) {
+    // Go by the last vsync delivered rather than the current time, so a late
+    // wakeup doesn't skip one
+    int64_t time = now;
+    if (last_timestamp_ >= 0)
+      time = std::min(time, last_timestamp_ + model_->period() / 2);
+    int64_t next = model_->GetNextVSync(time);
+    if (next >= 0 && !ArmTimerLocked(next, Source::kModel))
       return;
+  }
+
+  DrmCrtc *crtc = drm_->GetCrtcForDisplay(display_);
+  if (crtc && !drm_->event_listener()->RequestVBlank(crtc->pipe(), this)) {
+    vblank_pending_ = true;
+    return;
+  }
+
+  // Without vblank events, what the model learnt is better than the nominal
+  // rate, which is better than the 60Hz default
+  int64_t next = model_->GetNextVSync(now);
+  if (next < 0) {
+    int64_t frame_ns = nominal_period;
+    if (!frame_ns) {
+      ALOGW("Vsync worker active without a display mode\n");
+      frame_ns = kOneSecondNs / 60;
     }
+    next = GetPhasedVSync(frame_ns, now);
   }
+  ArmTimerLocked(next, Source::kSynthetic);
+}
+
+// Schedules the next vsync and calls the hook for this one, which can't be
+// done while holding the lock
+void VSyncWorker::DeliverLocked(AutoLock *lock, int64_t timestamp) {
+  last_timestamp_ = timestamp;
+  ScheduleLocked();
 
-  bool enabled = enabled_;
-  int display = display_;
   std::shared_ptr<VsyncCallback> callback(callback_);
+  int display = display_;
+  lock->Unlock();
 
-  ret = Unlock();
-  if (ret) {
-    ALOGE("Failed to unlock worker %d", ret);
-  }
+  if (callback)
+    callback->Callback(display, timestamp);
+}
 
-  if (!enabled)
+void VSyncWorker::HandleVBlank(unsigned int sequence, int64_t timestamp_ns) {
+  AutoLock lock(&lock_, "vsync");
+  if (lock.Lock())
     return;
 
-  DrmCrtc *crtc = drm_->GetCrtcForDisplay(display);
-  if (!crtc) {
-    ALOGE("Failed to get crtc for display");
+  vblank_pending_ = false;
+  bool accepted = model_->AddSample(sequence, timestamp_ns);
+  if (!accepted)
+    ALOGW("Rejected vblank %u at %" PRId64 " as outlier", sequence,
+          timestamp_ns);
+  if (!enabled_)
     return;
-  }
-  uint32_t high_crtc = (crtc->pipe() << DRM_VBLANK_HIGH_CRTC_SHIFT);
 
-  drmVBlank vblank;
-  memset(&vblank, 0, sizeof(vblank));
-  vblank.request.type = (drmVBlankSeqType)(
-      DRM_VBLANK_RELATIVE | (high_crtc & DRM_VBLANK_HIGH_CRTC_MASK));
-  vblank.request.sequence = 1;
+  // Vblank events keep being requested until one is taken, rather than going
+  // by the model for another resample_frames_ vsyncs after an outlier
+  frames_since_sample_ = accepted ? 0 : resample_frames_;
+  dump_vsyncs_[(int)Source::kHardware]++;
+  DeliverLocked(&lock, timestamp_ns);
+}
 
-  int64_t timestamp;
-  ret = drmWaitVBlank(drm_->fd(), &vblank);
-  if (ret == -EINTR) {
+void VSyncWorker::HandleEvent(uint64_t /* timestamp_us */) {
+  // Fails if the timer was disarmed or rearmed after it fired
+  uint64_t expirations;
+  if (read(timer_fd_.get(), &expirations, sizeof(expirations)) < 0)
     return;
-  } else if (ret) {
-    ret = SyntheticWaitVBlank(&timestamp);
-    if (ret)
-      return;
-  } else {
-    timestamp = (int64_t)vblank.reply.tval_sec * kOneSecondNs +
-                (int64_t)vblank.reply.tval_usec * 1000;
-  }
 
-  /*
-   * There's a race here where a change in callback_ will not take effect until
-   * the next subsequent requested vsync. This is unavoidable since we can't
-   * call the vsync hook while holding the thread lock.
-   *
-   * We could shorten the race window by caching callback_ right before calling
-   * the hook. However, in practice, callback_ is only updated once, so it's not
-   * worth the overhead.
-   */
-  if (callback)
-    callback->Callback(display, timestamp);
-  last_timestamp_ = timestamp;
+  AutoLock lock(&lock_, "vsync");
+  if (lock.Lock())
+    return;
+  if (!enabled_ || vblank_pending_)
+    return;
+
+  int64_t timestamp = timer_timestamp_;
+  int64_t latency_ns = GetTimeNs() - timestamp;
+  dump_latency_total_ns_ += latency_ns;
+  dump_latency_max_ns_ = std::max(dump_latency_max_ns_, latency_ns);
+  if (timer_source_ == Source::kModel)
+    frames_since_sample_++;
+  dump_vsyncs_[(int)timer_source_]++;
+  DeliverLocked(&lock, timestamp);
+}
+
+void VSyncWorker::Dump(std::ostringstream *out) const {
+  AutoLock lock(&lock_, "vsync");
+  if (lock.Lock())
+    return;
+
+  uint64_t timed = dump_vsyncs_[(int)Source::kModel] +
+                   dump_vsyncs_[(int)Source::kSynthetic];
+  *out << "--VSync: enabled=" << enabled_ << " locked=" << model_->locked()
+       << " period_ns=" << model_->period()
+       << " hardware=" << dump_vsyncs_[(int)Source::kHardware]
+       << " model=" << dump_vsyncs_[(int)Source::kModel]
+       << " synthetic=" << dump_vsyncs_[(int)Source::kSynthetic];
+  if (timed)
+    *out << " timer_latency_us[avg/max]="
+         << dump_latency_total_ns_ / (int64_t)timed / 1000 << "/"
+         << dump_latency_max_ns_ / 1000;
+  *out << "\n";
 }
 }
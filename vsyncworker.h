@@ -17,11 +17,17 @@
 #ifndef ANDROID_EVENT_WORKER_H_
 #define ANDROID_EVENT_WORKER_H_
 
+#include "autofd.h"
+#include "autolock.h"
+#include "drmeventlistener.h"
 #include "drmresources.h"
-#include "worker.h"
+#include "vsyncmodel.h"
 
-#include <map>
+#include <pthread.h>
 #include <stdint.h>
+#include <map>
+#include <memory>
+#include <sstream>
 
 #include <hardware/hardware.h>
 #include <hardware/hwcomposer.h>
@@ -35,7 +41,11 @@ class VsyncCallback {
   virtual void Callback(int display, int64_t timestamp) = 0;
 };
 
-class VSyncWorker : public Worker {
+// Delivers vsync of a display from the DRM event listener thread, shared by
+// all displays. Vblank events teach the model; once it's locked, vsync is
+// delivered from its predictions by a timer, and a vblank event is only
+// requested every resample_frames_ vsyncs to keep it locked.
+class VSyncWorker : public DrmEventHandler, public DrmVBlankHandler {
  public:
   VSyncWorker();
   ~VSyncWorker() override;
@@ -44,24 +54,66 @@ class VSyncWorker : public Worker {
   int RegisterCallback(std::shared_ptr<VsyncCallback> callback);
 
   int VSyncControl(bool enabled);
+  // Starts learning the display timing over, for when the display has been
+  // turned back on. Mode changes are noticed without it.
+  void ResetModel();
+
+  // Predicted time of the first vblank after time_ns, or -1 if the display
+  // timing isn't known yet
+  int64_t GetNextVSync(int64_t time_ns) const;
+  int64_t GetVSyncPeriod() const;
+  // Shared with components that schedule work against vblank
+  std::shared_ptr<const VSyncModel> model() const {
+    return model_;
+  }
+
+  void Dump(std::ostringstream *out) const;
 
- protected:
-  void Routine() override;
+  // Timer expiry and vblank events, on the event listener thread
+  void HandleEvent(uint64_t timestamp_us) override;
+  void HandleVBlank(unsigned int sequence, int64_t timestamp_ns) override;
 
  private:
+  enum class Source {
+    kHardware,
+    kModel,
+    kSynthetic,
+  };
+
   int64_t GetPhasedVSync(int64_t frame_ns, int64_t current);
-  int SyntheticWaitVBlank(int64_t *timestamp);
+  int64_t GetNominalPeriod();
+  void ResetModelLocked();
+  int ArmTimerLocked(int64_t timestamp, Source source);
+  void ScheduleLocked();
+  void DeliverLocked(AutoLock *lock, int64_t timestamp);
 
   DrmResources *drm_;
 
-  // shared_ptr since we need to use this outside of the thread lock (to
-  // actually call the hook) and we don't want the memory freed until we're
-  // done
+  // shared_ptr since we need to use this outside of the lock (to actually
+  // call the hook) and we don't want the memory freed until we're done
   std::shared_ptr<VsyncCallback> callback_ = NULL;
 
   int display_;
   bool enabled_;
   int64_t last_timestamp_;
+
+  mutable pthread_mutex_t lock_;
+  bool initialized_;
+  UniqueFd timer_fd_;
+  int64_t timer_timestamp_;
+  Source timer_source_;
+  bool vblank_pending_;
+
+  std::shared_ptr<VSyncModel> model_;
+  // The mode the model was learnt in
+  uint32_t mode_id_;
+  // 0 always waits for vblank events
+  int resample_frames_;
+  int frames_since_sample_;
+
+  uint64_t dump_vsyncs_[3];
+  int64_t dump_latency_total_ns_;
+  int64_t dump_latency_max_ns_;
 };
 }
 
@@ -18,21 +18,162 @@
 
 #include "worker.h"
 
+#include <dlfcn.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/signal.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
+
+#include <mutex>
 
 #include <cutils/log.h>
+#include <cutils/properties.h>
+#include <system/thread_defs.h>
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+#ifndef SCHED_RESET_ON_FORK
+#define SCHED_RESET_ON_FORK 0x40000000
+#endif
 
 namespace android {
 
 static const int64_t kBillion = 1000000000LL;
+// Until the display tells otherwise
+static const int64_t kDefaultSchedPeriodNs = kBillion / 60;
+
+static int64_t GetTimeNs() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+  return ts.tv_sec * kBillion + ts.tv_nsec;
+}
+
+namespace {
+
+struct SchedConfig {
+  bool fifo = false;
+  bool deadline = false;
+  int fifo_priority = 2;
+  int deadline_pct = 20;
+  bool use_cpus = false;
+  cpu_set_t cpus;
+  bool mlock = false;
+};
+
+// Not every libc has sched_setattr() or its struct
+struct SchedAttr {
+  uint32_t size;
+  uint32_t sched_policy;
+  uint64_t sched_flags;
+  int32_t sched_nice;
+  uint32_t sched_priority;
+  uint64_t sched_runtime;
+  uint64_t sched_deadline;
+  uint64_t sched_period;
+};
+}
+
+static SchedConfig LoadSchedConfig() {
+  SchedConfig config;
+  char policy_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.sched_policy", policy_opt, "nice");
+  config.deadline = !strcmp(policy_opt, "deadline");
+  config.fifo = config.deadline || !strcmp(policy_opt, "fifo");
+
+  char priority_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.sched_fifo_priority", priority_opt, "2");
+  config.fifo_priority = atoi(priority_opt);
+  if (config.fifo_priority < sched_get_priority_min(SCHED_FIFO) ||
+      config.fifo_priority > sched_get_priority_max(SCHED_FIFO)) {
+    ALOGW("Ignoring invalid SCHED_FIFO priority %s", priority_opt);
+    config.fifo_priority = 2;
+  }
+
+  char pct_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.sched_deadline_pct", pct_opt, "20");
+  config.deadline_pct = atoi(pct_opt);
+  if (config.deadline_pct <= 0 || config.deadline_pct > 100) {
+    ALOGW("Ignoring invalid SCHED_DEADLINE runtime share %s", pct_opt);
+    config.deadline_pct = 20;
+  }
+
+  char cpus_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.sched_cpus", cpus_opt, "");
+  unsigned long long mask = strtoull(cpus_opt, NULL, 16);
+  CPU_ZERO(&config.cpus);
+  for (int cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; ++cpu)
+    if (mask & (1ULL << cpu))
+      CPU_SET(cpu, &config.cpus);
+  config.use_cpus = mask != 0;
+
+  char mlock_opt[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.sched_mlock", mlock_opt, "0");
+  config.mlock = atoi(mlock_opt) != 0;
+  return config;
+}
+
+static const SchedConfig &GetSchedConfig() {
+  static const SchedConfig config = LoadSchedConfig();
+  return config;
+}
+
+// Keeps the code of the HAL from being paged out, so display threads don't
+// fault on it after a stretch of idle time
+static void LockHalCode() {
+  Dl_info info;
+  if (!dladdr((void *)&LockHalCode, &info) || !info.dli_fname) {
+    ALOGW("Failed to find the HAL's mappings to lock");
+    return;
+  }
+
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (!maps) {
+    ALOGW("Failed to open memory maps %d", -errno);
+    return;
+  }
+  size_t locked = 0;
+  char line[512];
+  while (fgets(line, sizeof(line), maps)) {
+    uintptr_t start, end;
+    char path[256];
+    if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " %*s %*s %*s %*s %255s", &start,
+               &end, path) != 3 ||
+        strcmp(path, info.dli_fname))
+      continue;
+    if (mlock((void *)start, end - start)) {
+      ALOGW("Failed to lock HAL mapping %d", -errno);
+      break;
+    }
+    locked += end - start;
+  }
+  fclose(maps);
+  ALOGI("Locked %zukb of HAL code and data", locked / 1024);
+}
 
 Worker::Worker(const char *name, int priority)
-    : name_(name), priority_(priority), exit_(false), initialized_(false) {
+    : name_(name),
+      priority_(priority),
+      exit_(false),
+      initialized_(false),
+      tid_(0),
+      sched_period_ns_(kDefaultSchedPeriodNs),
+      background_(false),
+      sched_policy_(kSchedNice),
+      signal_ns_(-1),
+      dump_wakeups_(0),
+      dump_wake_latency_total_ns_(0),
+      dump_wake_latency_max_ns_(0) {
 }
 
 Worker::~Worker() {
@@ -93,11 +234,7 @@ int Worker::ExitLocked() {
   if (signal_ret)
     ALOGE("Failed to signal thread %s with exit %d", name_.c_str(), signal_ret);
 
-  int join_ret = pthread_join(thread_, NULL);
-  if (join_ret && join_ret != ESRCH)
-    ALOGE("Failed to join thread %s in exit %d", name_.c_str(), join_ret);
-
-  return signal_ret | join_ret;
+  return signal_ret;
 }
 
 int Worker::Signal() {
@@ -131,7 +268,14 @@ int Worker::Exit() {
     ALOGE("Failed to release lock in Exit() %d\n", ret);
     return ret;
   }
-  return exit_ret;
+
+  // The thread needs the lock to return from WaitForSignalOrExitLocked and
+  // notice the exit request, so it is joined only once the lock is released
+  int join_ret = pthread_join(thread_, NULL);
+  if (join_ret && join_ret != ESRCH)
+    ALOGE("Failed to join thread %s in exit %d", name_.c_str(), join_ret);
+
+  return exit_ret | join_ret;
 }
 
 int Worker::WaitForSignalOrExitLocked(int64_t max_nanoseconds) {
@@ -139,6 +283,7 @@ int Worker::WaitForSignalOrExitLocked(int64_t max_nanoseconds) {
     return -EINTR;
 
   int ret = 0;
+  signal_ns_ = -1;
   if (max_nanoseconds < 0) {
     ret = pthread_cond_wait(&cond_, &lock_);
   } else {
@@ -150,9 +295,14 @@ int Worker::WaitForSignalOrExitLocked(int64_t max_nanoseconds) {
     abs_deadline.tv_sec += nanos / kBillion;
     abs_deadline.tv_nsec = nanos % kBillion;
     ret = pthread_cond_timedwait(&cond_, &lock_, &abs_deadline);
-    if (ret == ETIMEDOUT)
+    if (ret == ETIMEDOUT) {
       ret = -ETIMEDOUT;
+      RecordWakeLatency(GetTimeNs() - abs_deadline.tv_sec * kBillion -
+                        abs_deadline.tv_nsec);
+    }
   }
+  if (signal_ns_ >= 0)
+    RecordWakeLatency(GetTimeNs() - signal_ns_);
 
   if (exit_)
     return -EINTR;
@@ -164,7 +314,15 @@ int Worker::WaitForSignalOrExitLocked(int64_t max_nanoseconds) {
 void *Worker::InternalRoutine(void *arg) {
   Worker *worker = (Worker *)arg;
 
+  worker->tid_.store(gettid());
   setpriority(PRIO_PROCESS, 0, worker->priority_);
+  if (worker->priority_ == HAL_PRIORITY_URGENT_DISPLAY) {
+    static std::once_flag lock_code;
+    if (GetSchedConfig().mlock)
+      std::call_once(lock_code, LockHalCode);
+    if (!worker->background_.load())
+      worker->ApplySchedPolicy();
+  }
 
   while (true) {
     int ret = worker->Lock();
@@ -191,6 +349,8 @@ void *Worker::InternalRoutine(void *arg) {
 int Worker::SignalThreadLocked(bool exit) {
   if (exit)
     exit_ = exit;
+  if (signal_ns_ < 0)
+    signal_ns_ = GetTimeNs();
 
   int ret = pthread_cond_signal(&cond_);
   if (ret) {
@@ -200,4 +360,112 @@ int Worker::SignalThreadLocked(bool exit) {
 
   return 0;
 }
+
+void Worker::ApplySchedPolicy() {
+  const SchedConfig &config = GetSchedConfig();
+  pid_t tid = tid_.load();
+  if (!tid || !config.fifo)
+    return;
+
+  int policy = kSchedNice;
+  if (config.deadline) {
+    int64_t period_ns = sched_period_ns_.load();
+    SchedAttr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.sched_policy = SCHED_DEADLINE;
+    attr.sched_runtime = period_ns * config.deadline_pct / 100;
+    attr.sched_deadline = period_ns;
+    attr.sched_period = period_ns;
+#ifdef __NR_sched_setattr
+    int ret = syscall(__NR_sched_setattr, tid, &attr, 0) ? -errno : 0;
+#else
+    int ret = -ENOSYS;
+#endif
+    if (!ret)
+      policy = kSchedDeadline;
+    else
+      ALOGW("Failed to use SCHED_DEADLINE for %s thread %d, trying SCHED_FIFO",
+            name_.c_str(), ret);
+  }
+
+  if (policy == kSchedNice) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = config.fifo_priority;
+    if (!sched_setscheduler(tid, SCHED_FIFO | SCHED_RESET_ON_FORK, &param))
+      policy = kSchedFifo;
+    else
+      ALOGW("Failed to use SCHED_FIFO for %s thread %d", name_.c_str(),
+            -errno);
+  }
+
+  // The kernel doesn't let SCHED_DEADLINE threads have a narrower affinity
+  // than their root domain
+  if (config.use_cpus && policy != kSchedDeadline &&
+      sched_setaffinity(tid, sizeof(config.cpus), &config.cpus))
+    ALOGW("Failed to set the cpus of %s thread %d", name_.c_str(), -errno);
+
+  sched_policy_.store(policy);
+}
+
+void Worker::SetSchedPeriod(int64_t period_ns) {
+  if (period_ns <= 0 || period_ns == sched_period_ns_.load())
+    return;
+
+  sched_period_ns_.store(period_ns);
+  if (sched_policy_.load() == kSchedDeadline && !background_.load())
+    ApplySchedPolicy();
+}
+
+void Worker::SetBackground(bool background) {
+  background_.store(background);
+  pid_t tid = tid_.load();
+  if (!tid)
+    return;
+
+  if (background) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    if (sched_policy_.load() != kSchedNice &&
+        sched_setscheduler(tid, SCHED_OTHER | SCHED_RESET_ON_FORK, &param))
+      ALOGW("Failed to reset scheduling of %s thread %d", name_.c_str(),
+            -errno);
+    sched_policy_.store(kSchedNice);
+    setpriority(PRIO_PROCESS, tid, ANDROID_PRIORITY_BACKGROUND);
+  } else {
+    setpriority(PRIO_PROCESS, tid, priority_);
+    if (priority_ == HAL_PRIORITY_URGENT_DISPLAY)
+      ApplySchedPolicy();
+  }
+}
+
+void Worker::RecordWakeLatency(int64_t latency_ns) {
+  if (latency_ns < 0)
+    return;
+
+  dump_wakeups_.store(dump_wakeups_.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+  dump_wake_latency_total_ns_.store(
+      dump_wake_latency_total_ns_.load(std::memory_order_relaxed) + latency_ns,
+      std::memory_order_relaxed);
+  if (latency_ns > dump_wake_latency_max_ns_.load(std::memory_order_relaxed))
+    dump_wake_latency_max_ns_.store(latency_ns, std::memory_order_relaxed);
+}
+
+void Worker::DumpScheduling(std::ostringstream *out) const {
+  static const char *kPolicyNames[] = {"nice", "fifo", "deadline"};
+  uint64_t wakeups = dump_wakeups_.load(std::memory_order_relaxed);
+  *out << "----Thread " << name_ << " tid=" << tid_.load()
+       << " policy=" << kPolicyNames[sched_policy_.load()]
+       << " period_us=" << sched_period_ns_.load() / 1000
+       << " wakeups=" << wakeups;
+  if (wakeups)
+    *out << " wake_latency_avg_us="
+         << dump_wake_latency_total_ns_.load(std::memory_order_relaxed) /
+                (int64_t)wakeups / 1000
+         << " wake_latency_max_us="
+         << dump_wake_latency_max_ns_.load(std::memory_order_relaxed) / 1000;
+  *out << "\n";
+}
 }
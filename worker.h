@@ -19,6 +19,9 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <sstream>
 #include <string>
 
 namespace android {
@@ -36,6 +39,17 @@ class Worker {
   int Signal();
   int Exit();
 
+  // Display critical threads, those created with HAL_PRIORITY_URGENT_DISPLAY,
+  // are scheduled as hwc.drm.sched_policy says: "fifo" for SCHED_FIFO at
+  // hwc.drm.sched_fifo_priority, or "deadline" for SCHED_DEADLINE with a
+  // runtime of hwc.drm.sched_deadline_pct percent of period_ns, the refresh
+  // period of their display. hwc.drm.sched_cpus is a hex mask of the cpus they
+  // may run on, and hwc.drm.sched_mlock locks the HAL's code in memory.
+  // Whatever isn't permitted falls back to the next best thing, down to the
+  // plain nice value.
+  void SetSchedPeriod(int64_t period_ns);
+  void DumpScheduling(std::ostringstream *out) const;
+
  protected:
   Worker(const char *name, int priority);
   virtual ~Worker();
@@ -46,6 +60,13 @@ class Worker {
 
   virtual void Routine() = 0;
 
+  // Moves the thread out of its scheduling policy while it does something that
+  // isn't urgent, and back. Safe to call from any thread.
+  void SetBackground(bool background);
+  // How late the thread woke up for a signal or deadline, for threads that
+  // don't wait in WaitForSignalOrExitLocked
+  void RecordWakeLatency(int64_t latency_ns);
+
   /*
    * Must be called with the lock acquired. max_nanoseconds may be negative to
    * indicate infinite timeout, otherwise it indicates the maximum time span to
@@ -60,6 +81,14 @@ class Worker {
   // Must be called with the lock acquired
   int SignalThreadLocked(bool exit);
 
+  enum SchedPolicy {
+    kSchedNice,
+    kSchedFifo,
+    kSchedDeadline,
+  };
+
+  void ApplySchedPolicy();
+
   std::string name_;
   int priority_;
 
@@ -69,6 +98,18 @@ class Worker {
 
   bool exit_;
   bool initialized_;
+
+  std::atomic<pid_t> tid_;
+  std::atomic<int64_t> sched_period_ns_;
+  std::atomic<bool> background_;
+  std::atomic<int> sched_policy_;
+  // When the thread was signaled, protected by lock_
+  int64_t signal_ns_;
+
+  // Only written by the thread itself
+  std::atomic<uint64_t> dump_wakeups_;
+  std::atomic<int64_t> dump_wake_latency_total_ns_;
+  std::atomic<int64_t> dump_wake_latency_max_ns_;
 };
 }
 